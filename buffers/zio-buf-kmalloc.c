@@ -16,6 +16,7 @@
 #include <linux/fs.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
@@ -27,6 +28,14 @@ struct zbk_instance {
 	struct zio_bi bi;
 	int nitem;		/* allocated item */
 	struct list_head list; /* items list and lock */
+	/* pre-allocated blocks, recycled on free (under bi->lock) */
+	struct list_head pool;
+	int npool;		/* free items in the pool */
+	size_t pool_len;	/* data size of pool items, 0 if disabled */
+	uint32_t pool_misses;	/* blocks allocated out of the pool */
+	size_t req_pool_len;	/* size for the work, with pool_rebuild */
+	int pool_rebuild;
+	struct work_struct pool_work;
 };
 #define to_zbki(bi) container_of(bi, struct zbk_instance, bi)
 
@@ -39,9 +48,107 @@ struct zbk_item {
 	struct list_head list;	/* item list */
 	struct zbk_instance *instance;
 	size_t len; /* block.datalen may change, so save this */
+	size_t pool_len; /* data size, if it comes from the pool */
 };
 #define to_item(block) container_of(block, struct zbk_item, block)
 
+/*
+ * A pool item is a single allocation: the item, then the control and
+ * the data. It is sized from the trigger's nsamples, so in steady state
+ * alloc and free only move it between the pool and the buffer.
+ */
+#define ZBK_POOL_CTRL	ALIGN(sizeof(struct zbk_item), L1_CACHE_BYTES)
+#define ZBK_POOL_DATA	(ZBK_POOL_CTRL + __ZIO_CONTROL_SIZE)
+
+enum {
+	ZBK_ATTR_POOL = ZIO_MAX_STD_ATTR,
+	ZBK_ATTR_POOL_MISSES,
+};
+
+static struct zbk_item *zbk_pool_new(size_t len, gfp_t gfp, int node)
+{
+	struct zbk_item *item;
+
+	item = kmalloc_node(ZBK_POOL_DATA + len, gfp, node);
+	if (!item)
+		return NULL;
+	memset(item, 0, sizeof(*item));
+	item->pool_len = len;
+	zio_init_control((void *)item + ZBK_POOL_CTRL);
+	return item;
+}
+
+static size_t zbk_pool_len(struct zio_channel *chan)
+{
+	return chan->cset->ssize * chan->cset->ti->nsamples;
+}
+
+/* Top up the pool, so that busy and free items reach maxlen */
+static void zbk_pool_fill(struct zbk_instance *zbki, uint32_t maxlen,
+			  gfp_t gfp)
+{
+	struct zio_bi *bi = &zbki->bi;
+	struct zbk_item *item;
+	unsigned long flags;
+	size_t len;
+
+	do {
+		spin_lock_irqsave(&bi->lock, flags);
+		len = zbki->pool_len;
+		if (!len || zbki->nitem + zbki->npool >= maxlen) {
+			spin_unlock_irqrestore(&bi->lock, flags);
+			return;
+		}
+		spin_unlock_irqrestore(&bi->lock, flags);
+
+		item = zbk_pool_new(len, gfp, bi->node);
+		if (!item)
+			return;
+
+		spin_lock_irqsave(&bi->lock, flags);
+		if (len == zbki->pool_len &&
+		    zbki->nitem + zbki->npool < maxlen) {
+			list_add(&item->list, &zbki->pool);
+			zbki->npool++;
+			item = NULL;
+		}
+		spin_unlock_irqrestore(&bi->lock, flags);
+	} while (!item);
+	kfree(item);
+}
+
+/* Release the free items, e.g. because nsamples changed */
+static void zbk_pool_drain(struct zbk_instance *zbki, size_t new_len)
+{
+	struct zio_bi *bi = &zbki->bi;
+	struct zbk_item *item, *tmp;
+	unsigned long flags;
+	LIST_HEAD(list);
+
+	spin_lock_irqsave(&bi->lock, flags);
+	list_splice_init(&zbki->pool, &list);
+	zbki->npool = 0;
+	zbki->pool_len = new_len;
+	zbki->req_pool_len = 0;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	list_for_each_entry_safe(item, tmp, &list, list)
+		kfree(item);
+}
+
+/* Called with bi->lock held, it returns 1 if the item was recycled */
+static int zbk_pool_put(struct zbk_instance *zbki, struct zbk_item *item)
+{
+	if (!item->pool_len || item->pool_len != zbki->pool_len)
+		return 0;
+	if (zbki->nitem + zbki->npool >=
+	    zio_bi_std_val(&zbki->bi, ZIO_ATTR_ZBUF_MAXLEN))
+		return 0;
+	list_add(&item->list, &zbki->pool);
+	zbki->npool++;
+	return 1;
+}
+
 static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
 	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_MAXLEN, ZIO_RW_PERM,
 		 ZIO_ATTR_ZBUF_MAXLEN, 16),
@@ -49,10 +156,67 @@ static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
 		 ZIO_ATTR_ZBUF_ALLOC_LEN, 0),
 };
 
+static struct zio_attribute zbk_ext_attr[] = {
+	/* writing 1 rebuilds the pool for the current nsamples */
+	ZIO_PARAM_EXT("block-pool", ZIO_RW_PERM,
+		     ZBK_ATTR_POOL, 0),
+	ZIO_PARAM_EXT("pool-misses", ZIO_RO_PERM,
+		     ZBK_ATTR_POOL_MISSES, 0),
+};
+
+/*
+ * The pool is rebuilt (blocks grew, or block-pool was written) and
+ * topped up (max-buffer-len changed) here, in process context.
+ */
+static void zbk_pool_work(struct work_struct *work)
+{
+	struct zbk_instance *zbki = container_of(work, struct zbk_instance,
+						 pool_work);
+	struct zio_bi *bi = &zbki->bi;
+	unsigned long flags;
+	int rebuild;
+	size_t len;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	rebuild = zbki->pool_rebuild;
+	len = zbki->req_pool_len;
+	zbki->pool_rebuild = 0;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (rebuild)
+		zbk_pool_drain(zbki, len);
+	zbk_pool_fill(zbki, zio_bi_std_val(bi, ZIO_ATTR_ZBUF_MAXLEN),
+		      GFP_KERNEL);
+}
+
+/* Called with bi->lock held */
+static void __zbk_pool_rebuild(struct zbk_instance *zbki, size_t len)
+{
+	zbki->req_pool_len = len;
+	zbki->pool_rebuild = 1;
+	schedule_work(&zbki->pool_work);
+}
+
+/* conf_set is called in atomic context (the device lock is held) */
 static int zbk_conf_set(struct device *dev, struct zio_attribute *zattr,
 		uint32_t  usr_val)
 {
 	struct zio_bi *bi = to_zio_bi(dev);
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned long flags;
+
+	switch (zattr->id) {
+	case ZIO_ATTR_ZBUF_MAXLEN:
+		/* the work tops up the pool to the new value */
+		schedule_work(&zbki->pool_work);
+		break;
+	case ZBK_ATTR_POOL:
+		spin_lock_irqsave(&bi->lock, flags);
+		__zbk_pool_rebuild(zbki, usr_val ? zbk_pool_len(bi->chan) : 0);
+		spin_unlock_irqrestore(&bi->lock, flags);
+		return 0;
+	default:
+		return -EINVAL;
+	}
 
 	/* If somebody is sleeping for write and we increase the size... */
 	wake_up_interruptible(&bi->q);
@@ -69,6 +233,9 @@ static int zbk_info_get(struct device *dev, struct zio_attribute *zattr,
 	case ZIO_ATTR_ZBUF_ALLOC_LEN:
 		*usr_val = zbki->nitem;
 		break;
+	case ZBK_ATTR_POOL_MISSES:
+		*usr_val = zbki->pool_misses;
+		break;
 	case ZIO_ATTR_ZBUF_MAXLEN:
 	default:
 		break;
@@ -101,12 +268,35 @@ static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
 		goto out_unlock;
 	}
 	zbki->nitem++;
+	if (!list_empty(&zbki->pool) && zbki->pool_len >= datalen) {
+		item = list_first_entry(&zbki->pool, struct zbk_item, list);
+		list_del(&item->list);
+		zbki->npool--;
+		spin_unlock_irqrestore(&bi->lock, flags);
+
+		ctrl = (void *)item + ZBK_POOL_CTRL;
+		zio_init_control(ctrl);
+		item->block.data = (void *)item + ZBK_POOL_DATA;
+		item->block.datalen = datalen;
+		item->block.uoff = 0;
+		item->len = datalen;
+		item->instance = zbki;
+		zio_set_ctrl(&item->block, ctrl);
+		return &item->block;
+	}
+	if (zbki->pool_len) {
+		zbki->pool_misses++;
+		/* on the first miss for a new size, resize the pool */
+		if (datalen > zbki->pool_len &&
+		    datalen != zbki->req_pool_len)
+			__zbk_pool_rebuild(zbki, datalen);
+	}
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 	/* alloc item and data. Control remains null at this point */
-	item = kmem_cache_alloc(zbk_slab, gfp);
-	data = kmalloc(datalen, gfp);
-	ctrl = zio_alloc_control(gfp);
+	item = kmem_cache_alloc_node(zbk_slab, gfp, bi->node);
+	data = kmalloc_node(datalen, gfp, bi->node);
+	ctrl = zio_alloc_control_node(gfp, bi->node);
 	if (!item || !data || !ctrl)
 		goto out_free;
 	memset(item, 0, sizeof(*item));
@@ -134,16 +324,21 @@ static void zbk_free_block(struct zio_bi *bi, struct zio_block *block)
 	struct zbk_item *item;
 	struct zbk_instance *zbki;
 	unsigned long flags;
-	int awake = 0;
+	int awake = 0, recycled;
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
 	item = to_item(block);
 	zbki = item->instance;
 
+	/* sniff before the control can be reused */
+	if (item->pool_len && zio_sniffdev_active())
+		zio_sniffdev_add(zio_get_ctrl(block));
+
 	if (bi->flags & ZIO_BI_PUSHING) {
 		/* freed while pushing: we hold the bi lock already */
 		zbki->nitem--;
+		recycled = zbk_pool_put(zbki, item);
 		goto out_free;
 	}
 
@@ -154,12 +349,18 @@ static void zbk_free_block(struct zio_bi *bi, struct zio_block *block)
 		awake = 1;
 	bi->flags &= ~ZIO_BI_NOSPACE;
 	zbki->nitem--;
+	recycled = zbk_pool_put(zbki, item);
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 out_free:
-	kfree(block->data);
-	zio_free_control(zio_get_ctrl(block));
-	kmem_cache_free(zbk_slab, item);
+	if (item->pool_len) {
+		if (!recycled)
+			kfree(item);
+	} else {
+		kfree(block->data);
+		zio_free_control(zio_get_ctrl(block));
+		kmem_cache_free(zbk_slab, item);
+	}
 	if (awake)
 		wake_up_interruptible(&bi->q);
 }
@@ -185,14 +386,16 @@ static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
 		else
 			awake = 1;
 	}
-	if (!pushed)
+	if (!pushed) {
 		list_add_tail(&item->list, &zbki->list);
+		atomic_inc(&bi->nready);
+	}
 
 	spin_unlock_irqrestore(&bi->lock, flags);
 
-	/* if first input, awake user space */
-	if (awake)
-		wake_up_interruptible(&bi->q);
+	/* awake user space, if it waited for this block */
+	if (!output)
+		zio_bi_wake_reader(bi, block->datalen, awake);
 	return 0;
 }
 
@@ -218,6 +421,7 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 	first = zbki->list.next;
 	item = list_entry(first, struct zbk_item, list);
 	list_del(&item->list);
+	atomic_dec(&bi->nready);
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, item);
@@ -242,13 +446,31 @@ static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
 				 struct zio_channel *chan)
 {
 	struct zbk_instance *zbki;
+	struct zbk_item *item;
+	uint32_t i, maxlen;
+	int node;
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
-	zbki = kzalloc(sizeof(*zbki), GFP_ATOMIC);
+	node = zio_chan_to_node(chan);
+	zbki = kzalloc_node(sizeof(*zbki), GFP_KERNEL, node);
 	if (!zbki)
 		return ERR_PTR(-ENOMEM);
 	INIT_LIST_HEAD(&zbki->list);
+	INIT_LIST_HEAD(&zbki->pool);
+	INIT_WORK(&zbki->pool_work, zbk_pool_work);
+
+	/* Nobody sees us yet: fill the pool without locking */
+	if (zbuf->zattr_set.ext_zattr[0].value)
+		zbki->pool_len = zbk_pool_len(chan);
+	maxlen = zbuf->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXLEN].value;
+	for (i = 0; zbki->pool_len && i < maxlen; i++) {
+		item = zbk_pool_new(zbki->pool_len, GFP_KERNEL, node);
+		if (!item)
+			break;
+		list_add(&item->list, &zbki->pool);
+		zbki->npool++;
+	}
 
 	/* all the fields of zio_bi are initialied by the caller */
 	return &zbki->bi;
@@ -263,11 +485,13 @@ static void zbk_destroy(struct zio_bi *bi)
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
+	cancel_work_sync(&zbki->pool_work);
 	/* no need to lock here, zio ensures we are not active */
 	list_for_each_safe(pos, tmp, &zbki->list) {
 		item = list_entry(pos, struct zbk_item, list);
 		zbk_free_block(&zbki->bi, &item->block);
 	}
+	zbk_pool_drain(zbki, 0);
 	kfree(zbki);
 }
 
@@ -284,6 +508,8 @@ static struct zio_buffer_type zbk_buffer = {
 	.owner =	THIS_MODULE,
 	.zattr_set = {
 		.std_zattr = zbk_std_zattr,
+		.ext_zattr = zbk_ext_attr,
+		.n_ext_attr = ARRAY_SIZE(zbk_ext_attr),
 	},
 	.s_op = &zbk_sysfs_ops,
 	.b_op = &zbk_buffer_ops,
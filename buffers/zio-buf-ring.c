@@ -0,0 +1,592 @@
+/* Federico Vaga for CERN, 2019, GNU GPLv2 or later */
+
+/*
+ * This is a single-producer single-consumer ring buffer for the ZIO
+ * framework. Controls and data live in fixed-size slots of a single
+ * vmalloc area, whose first page is a struct zio_ring_header. The whole
+ * area can be mapped by user space, so a reader can consume blocks
+ * by looking at head and writing tail, without calling read().
+ *
+ * The producer is the trigger (data_done is serialized by the cset lock)
+ * and the consumer is either f->read or the mmap user: the producer takes
+ * no lock, indexes are published with acquire/release ordering. f->read
+ * may hold several blocks at once (shared-read, the gather device), so
+ * it has its own cursor, under the bi lock, and moves tail in order.
+ * The tail written by user space is never trusted beyond the ring.
+ * The prefix of all local code/data is still "zbk_", like the other
+ * buffers, so "diff" among the implementations shows what changes.
+ */
+
+#include <linux/version.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/types.h>
+
+#include <linux/zio.h>
+#include <linux/zio-buffer.h>
+#include <linux/zio-trigger.h>
+
+struct zbk_instance;
+
+/* One item per slot, allocated with the instance */
+struct zbk_item {
+	struct zio_block block;
+	struct zbk_instance *instance;
+	uint32_t seq; /* ring index when reserved or retrieved */
+	int released; /* retrieved and freed, waiting for tail */
+};
+#define to_item(block) container_of(block, struct zbk_item, block)
+
+struct zbk_instance {
+	struct zio_bi bi;
+	struct zio_ring_header *hdr;	/* first page of the area */
+	struct zbk_item *items;
+	unsigned int nslots;		/* power of two */
+	unsigned long slot_size;
+	unsigned long size;		/* of the whole area */
+	unsigned long flags;
+	atomic_t map_count;
+	uint32_t rpos;			/* next for retr, bi lock */
+	unsigned int nout;		/* retrieved and not freed, bi lock */
+	uint32_t maxlen, maxkb;		/* current geometry */
+	uint32_t req_maxlen, req_maxkb;	/* requested, for the work */
+	struct work_struct work;
+};
+#define to_zbki(bi) container_of(bi, struct zbk_instance, bi)
+
+#define ZBK_FLAG_RESERVED	0 /* bit number: a slot is being filled */
+
+static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
+	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_MAXLEN, ZIO_RW_PERM,
+		 ZIO_ATTR_ZBUF_MAXLEN, 16),
+	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_MAXKB, ZIO_RW_PERM,
+		 ZIO_ATTR_ZBUF_MAXKB, 128),
+	ZIO_ATTR(zbuf, ZIO_ATTR_ZBUF_ALLOC_LEN, ZIO_RO_PERM,
+		 ZIO_ATTR_ZBUF_ALLOC_LEN, 0),
+};
+
+/*
+ * The ring can only be rebuilt when no slot is in use outside of it:
+ * blocks held by readers point to the slots until they are freed.
+ * Called with bi->lock held.
+ */
+static int zbk_busy(struct zbk_instance *zbki)
+{
+	return zbki->nout || atomic_read(&zbki->map_count) ||
+		test_bit(ZBK_FLAG_RESERVED, &zbki->flags);
+}
+
+/*
+ * Build the area for the given geometry: the header page, then the
+ * controls, then the data slots. The number of slots is rounded up to
+ * a power of two, so free-running indexes wrap correctly. On rebuild,
+ * the new area only replaces the old one if the ring is not busy.
+ */
+static int zbk_setup(struct zbk_instance *zbki, uint32_t maxlen,
+		     uint32_t maxkb, int node, int rebuild)
+{
+	struct zio_ring_header *hdr, *old_hdr;
+	struct zbk_item *items, *old_items;
+	unsigned long ctrl_offset, data_offset, slot_size, size;
+	unsigned long flags = 0;
+	unsigned int i, nslots;
+
+	if (!maxlen || !maxkb)
+		return -EINVAL;
+	nslots = roundup_pow_of_two(maxlen);
+	slot_size = rounddown(maxkb * 1024 / nslots, L1_CACHE_BYTES);
+	if (!slot_size)
+		return -EINVAL;
+	ctrl_offset = PAGE_SIZE;
+	data_offset = PAGE_ALIGN(ctrl_offset + nslots * __ZIO_CONTROL_SIZE);
+	size = PAGE_ALIGN(data_offset + nslots * slot_size);
+
+	items = kzalloc_node(nslots * sizeof(*items), GFP_KERNEL, node);
+	/* Zeroed, as it goes to user space; zbk_fault maps it by page */
+	hdr = vzalloc_node(size, node);
+	if (!items || !hdr) {
+		kfree(items);
+		vfree(hdr);
+		return -ENOMEM;
+	}
+	hdr->nslots = nslots;
+	hdr->slot_size = slot_size;
+	hdr->ctrl_offset = ctrl_offset;
+	hdr->data_offset = data_offset;
+	for (i = 0; i < nslots; i++) {
+		items[i].instance = zbki;
+		items[i].block.data = (void *)hdr + data_offset
+			+ i * slot_size;
+		zio_set_ctrl(&items[i].block, (void *)hdr + ctrl_offset
+			     + i * __ZIO_CONTROL_SIZE);
+	}
+
+	/* At create time the lock is not initialized yet, nor needed */
+	if (rebuild) {
+		spin_lock_irqsave(&zbki->bi.lock, flags);
+		if (zbk_busy(zbki)) {
+			spin_unlock_irqrestore(&zbki->bi.lock, flags);
+			kfree(items);
+			vfree(hdr);
+			return -EBUSY;
+		}
+	}
+	old_hdr = zbki->hdr;
+	old_items = zbki->items;
+	zbki->hdr = hdr;
+	zbki->items = items;
+	zbki->nslots = nslots;
+	zbki->slot_size = slot_size;
+	zbki->size = size;
+	zbki->rpos = 0;
+	zbki->maxlen = maxlen;
+	zbki->maxkb = maxkb;
+	if (rebuild)
+		spin_unlock_irqrestore(&zbki->bi.lock, flags);
+	vfree(old_hdr);
+	kfree(old_items);
+	return 0;
+}
+
+/*
+ * Geometry changes are applied here, in process context: the ring is
+ * flushed and built again, with the trigger disabled meanwhile. If a
+ * reader took a block meanwhile, the ring is busy and nothing changes.
+ */
+static void zbk_work(struct work_struct *work)
+{
+	struct zbk_instance *zbki = container_of(work, struct zbk_instance,
+						 work);
+	struct zio_bi *bi = &zbki->bi;
+	struct zio_ti *ti = bi->cset->ti;
+	struct zio_block *block;
+	unsigned long flags, bflags, tflags;
+	uint32_t maxlen, maxkb;
+	int node, err = -EBUSY;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	maxlen = zbki->req_maxlen;
+	maxkb = zbki->req_maxkb;
+	node = bi->node;
+	if (maxlen == zbki->maxlen && maxkb == zbki->maxkb) {
+		spin_unlock_irqrestore(&bi->lock, flags);
+		return;
+	}
+	/* Lock and disable, like vmalloc does: mapped rings can't move */
+	if (atomic_read(&zbki->map_count) || zbki->nout) {
+		spin_unlock_irqrestore(&bi->lock, flags);
+		goto out;
+	}
+	bflags = bi->flags;
+	bi->flags |= ZIO_DISABLED;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	/* The reserved slot is released by abort, then we flush */
+	tflags = zio_trigger_abort_disable(ti->cset, 1);
+	while ((block = bi->b_op->retr_block(bi)))
+		bi->b_op->free_block(bi, block);
+
+	err = zbk_setup(zbki, maxlen, maxkb, node, 1);
+
+	spin_lock_irqsave(&bi->lock, flags);
+	bi->flags = bflags;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	if ((tflags & ZIO_STATUS) == ZIO_ENABLED)
+		ti->flags = (ti->flags & ~ZIO_STATUS) | ZIO_ENABLED;
+	if (tflags & ZIO_TI_ARMED)
+		zio_arm_trigger(ti);
+out:
+	if (!err)
+		return;
+	dev_err(&bi->head.dev, "can't change geometry (%i)\n", err);
+	/* Report what is still in place */
+	spin_lock_irqsave(&bi->lock, flags);
+	zbki->req_maxlen = zbki->maxlen;
+	zbki->req_maxkb = zbki->maxkb;
+	bi->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXLEN].value = zbki->maxlen;
+	bi->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXKB].value = zbki->maxkb;
+	spin_unlock_irqrestore(&bi->lock, flags);
+}
+
+/* conf_set is called in atomic context: the rebuild is deferred */
+static int zbk_conf_set(struct device *dev, struct zio_attribute *zattr,
+		uint32_t  usr_val)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned long flags;
+	uint32_t maxlen, maxkb;
+
+	maxlen = zio_bi_std_val(bi, ZIO_ATTR_ZBUF_MAXLEN);
+	maxkb = zio_bi_std_val(bi, ZIO_ATTR_ZBUF_MAXKB);
+	switch (zattr->id) {
+	case ZIO_ATTR_ZBUF_MAXLEN:
+		maxlen = usr_val;
+		break;
+	case ZIO_ATTR_ZBUF_MAXKB:
+		maxkb = usr_val;
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (usr_val == zattr->value)
+		return 0; /* nothing to do */
+	/* Same checks as zbk_setup(), which can't report to the writer */
+	if (!maxlen || !maxkb ||
+	    maxkb * 1024 / roundup_pow_of_two(maxlen) < L1_CACHE_BYTES)
+		return -EINVAL;
+
+	/* Readers holding blocks or maps would see the ring move */
+	spin_lock_irqsave(&bi->lock, flags);
+	if (atomic_read(&zbki->map_count) || zbki->nout) {
+		spin_unlock_irqrestore(&bi->lock, flags);
+		return -EBUSY;
+	}
+	zbki->req_maxlen = maxlen;
+	zbki->req_maxkb = maxkb;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	schedule_work(&zbki->work);
+	return 0;
+}
+
+static int zbk_info_get(struct device *dev, struct zio_attribute *zattr,
+			 uint32_t *usr_val)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned long flags;
+
+	switch (zattr->id) {
+	case ZIO_ATTR_ZBUF_ALLOC_LEN:
+		/* The work may replace hdr, under the lock */
+		spin_lock_irqsave(&bi->lock, flags);
+		*usr_val = READ_ONCE(zbki->hdr->head) -
+			READ_ONCE(zbki->hdr->tail);
+		spin_unlock_irqrestore(&bi->lock, flags);
+		break;
+	default:
+		break;
+	}
+
+	return 0;
+}
+static struct zio_sysfs_operations zbk_sysfs_ops = {
+	.conf_set = zbk_conf_set,
+	.info_get = zbk_info_get,
+};
+
+/*
+ * Alloc is called by the trigger: it reserves the slot at head, which is
+ * published by store. We never set ZIO_BI_NOSPACE, because "prefer-new"
+ * would turn the producer into a second consumer: when the ring is full
+ * new data is lost, and the trigger reports it.
+ */
+static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
+					 size_t datalen, gfp_t gfp)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+	struct zio_ring_header *hdr = zbki->hdr;
+	struct zbk_item *item;
+	unsigned int slot;
+	uint32_t head;
+
+	if (unlikely(datalen > zbki->slot_size)) {
+		dev_dbg(&bi->head.dev, "block of %zi bytes, slot is %li\n",
+			datalen, zbki->slot_size);
+		return NULL;
+	}
+	if (test_and_set_bit(ZBK_FLAG_RESERVED, &zbki->flags))
+		return NULL; /* single producer: one block at a time */
+
+	head = hdr->head;
+	if (head - READ_ONCE(hdr->tail) >= zbki->nslots) {
+		clear_bit(ZBK_FLAG_RESERVED, &zbki->flags);
+		return NULL;
+	}
+	slot = head & (zbki->nslots - 1);
+	item = &zbki->items[slot];
+	item->seq = head;
+	item->block.datalen = datalen;
+	item->block.uoff = 0;
+	zio_set_ctrl(&item->block, (void *)hdr + hdr->ctrl_offset
+		     + slot * __ZIO_CONTROL_SIZE);
+
+	/* mem_offset in current_ctrl is the last allocated */
+	bi->chan->current_ctrl->mem_offset = item->block.data - (void *)hdr;
+	return &item->block;
+}
+
+/*
+ * Free is called by f->read, or by the trigger for a reserved slot that
+ * was not stored. Blocks may be freed out of order: tail only moves over
+ * the released ones. If the mmap user already moved tail, we leave it.
+ */
+static void zbk_free_block(struct zio_bi *bi, struct zio_block *block)
+{
+	struct zbk_item *item = to_item(block);
+	struct zbk_instance *zbki = item->instance;
+	struct zio_ring_header *hdr = zbki->hdr;
+	unsigned int mask = zbki->nslots - 1;
+	unsigned long flags;
+	uint32_t tail, next;
+
+	if (test_bit(ZBK_FLAG_RESERVED, &zbki->flags) &&
+	    item->seq == hdr->head) {
+		clear_bit(ZBK_FLAG_RESERVED, &zbki->flags);
+		return;
+	}
+
+	spin_lock_irqsave(&bi->lock, flags);
+	zbki->nout--;
+	item->released = 1;
+	tail = READ_ONCE(hdr->tail);
+	if (zbki->rpos - tail <= zbki->nslots) {
+		for (next = tail; next != zbki->rpos; next++) {
+			item = &zbki->items[next & mask];
+			if (item->seq != next || !item->released)
+				break;
+			item->released = 0;
+		}
+		if (next != tail)
+			cmpxchg(&hdr->tail, tail, next);
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+}
+
+/* Store is called by the trigger: publish the reserved slot */
+static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
+{
+	struct zbk_item *item = to_item(block);
+	struct zbk_instance *zbki = item->instance;
+	struct zio_ring_header *hdr = zbki->hdr;
+	int first;
+
+	zio_get_ctrl(block)->mem_offset = block->data - (void *)hdr;
+
+	first = (item->seq == READ_ONCE(hdr->tail));
+	smp_store_release(&hdr->head, item->seq + 1);
+	clear_bit(ZBK_FLAG_RESERVED, &zbki->flags);
+
+	/* awake user space, if it waited for this block */
+	zio_bi_wake_reader(bi, block->datalen, first);
+	return 0;
+}
+
+/*
+ * Retr is called by f->read: each stored block is returned once, and
+ * the slot is released by free. Blocks before tail were consumed by the
+ * mmap user; a tail outside the ring means there is nothing to read.
+ */
+static struct zio_block *zbk_retr_block(struct zio_bi *bi)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+	struct zio_ring_header *hdr;
+	struct zbk_item *item = NULL;
+	struct zio_ti *ti;
+	unsigned long flags;
+	uint32_t head, tail;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	hdr = zbki->hdr; /* the work may replace it, under the lock */
+	tail = READ_ONCE(hdr->tail);
+	head = smp_load_acquire(&hdr->head);
+	if (head - tail <= zbki->nslots) {
+		if ((int32_t)(tail - zbki->rpos) > 0)
+			zbki->rpos = tail;
+		if (zbki->rpos != head) {
+			item = &zbki->items[zbki->rpos & (zbki->nslots - 1)];
+			item->seq = zbki->rpos++;
+			item->released = 0;
+			zbki->nout++;
+		}
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (item)
+		return &item->block;
+
+	/* There is no data in buffer, and we may pull to have data soon */
+	ti = bi->cset->ti;
+	if (ti->t_op->pull_block) {
+		/* chek if trigger is disabled */
+		if (unlikely((ti->flags & ZIO_STATUS) == ZIO_DISABLED))
+			return NULL;
+		ti->t_op->pull_block(ti, bi->chan);
+	}
+	return NULL;
+}
+
+/* Ready blocks are those not retrieved yet; the lock pins hdr */
+static unsigned int zbk_nready(struct zio_bi *bi)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+	uint32_t head, tail, rpos, nslots;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	head = smp_load_acquire(&zbki->hdr->head);
+	tail = READ_ONCE(zbki->hdr->tail);
+	rpos = zbki->rpos;
+	nslots = zbki->nslots;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	if (head - tail > nslots)
+		return 0;
+	if ((int32_t)(tail - rpos) > 0)
+		rpos = tail;
+	return head - rpos;
+}
+
+/* Create is called by zio for each channel electing to use this buffer type */
+static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
+				 struct zio_channel *chan)
+{
+	struct zbk_instance *zbki;
+	int node, err;
+
+	/* zero-sized blocks can't use this buffer type */
+	if (chan->cset->ssize == 0)
+		return ERR_PTR(-EINVAL);
+	/* the ring only flows towards user space */
+	if ((chan->cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return ERR_PTR(-EINVAL);
+
+	node = zio_chan_to_node(chan);
+	zbki = kzalloc_node(sizeof(*zbki), GFP_KERNEL, node);
+	if (!zbki)
+		return ERR_PTR(-ENOMEM);
+	err = zbk_setup(zbki,
+			zbuf->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXLEN].value,
+			zbuf->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXKB].value,
+			node, 0);
+	if (err) {
+		kfree(zbki);
+		return ERR_PTR(err);
+	}
+	zbki->req_maxlen = zbki->maxlen;
+	zbki->req_maxkb = zbki->maxkb;
+	INIT_WORK(&zbki->work, zbk_work);
+
+	/* all the fields of zio_bi are initialied by the caller */
+	return &zbki->bi;
+}
+
+/* destroy is called by zio on channel removal or if it changes buffer type */
+static void zbk_destroy(struct zio_bi *bi)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+
+	/* no need to lock here, zio ensures we are not active */
+	cancel_work_sync(&zbki->work);
+	vfree(zbki->hdr);
+	kfree(zbki->items);
+	kfree(zbki);
+}
+
+static const struct zio_buffer_operations zbk_buffer_ops = {
+	.alloc_block =	zbk_alloc_block,
+	.free_block =	zbk_free_block,
+	.store_block =	zbk_store_block,
+	.retr_block =	zbk_retr_block,
+	.create =	zbk_create,
+	.destroy =	zbk_destroy,
+	.nready =	zbk_nready,
+};
+
+/* Both cdevs map the whole area: header, controls and data */
+static void zbk_open(struct vm_area_struct *vma)
+{
+	struct zio_f_priv *priv = vma->vm_file->private_data;
+	struct zio_bi *bi = priv->chan->bi;
+
+	atomic_inc(&to_zbki(bi)->map_count);
+}
+
+static void zbk_close(struct vm_area_struct *vma)
+{
+	struct zio_f_priv *priv = vma->vm_file->private_data;
+	struct zio_bi *bi = priv->chan->bi;
+
+	atomic_dec(&to_zbki(bi)->map_count);
+}
+
+static int __zbk_fault(struct vm_fault *vmf, struct file *f)
+{
+	struct zio_f_priv *priv = f->private_data;
+	struct zio_bi *bi = priv->chan->bi;
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned long off = vmf->pgoff * PAGE_SIZE;
+	struct page *p;
+
+	if (off >= zbki->size)
+		return VM_FAULT_SIGBUS;
+	p = vmalloc_to_page((void *)zbki->hdr + off);
+	get_page(p);
+	vmf->page = p;
+	return 0;
+}
+
+#if KERNEL_VERSION(4, 11, 0) > LINUX_VERSION_CODE
+static int zbk_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	return __zbk_fault(vmf, vma->vm_file);
+}
+#else
+#if KERNEL_VERSION(4, 17, 0) > LINUX_VERSION_CODE
+static int zbk_fault(struct vm_fault *vmf)
+{
+	return __zbk_fault(vmf, vmf->vma->vm_file);
+}
+#else
+static vm_fault_t zbk_fault(struct vm_fault *vmf)
+{
+	return __zbk_fault(vmf, vmf->vma->vm_file);
+}
+#endif
+#endif
+
+static struct vm_operations_struct zbk_vma_ops = {
+	.open = zbk_open,
+	.close = zbk_close,
+	.fault = zbk_fault,
+};
+
+static struct zio_buffer_type zbk_buffer = {
+	.owner =	THIS_MODULE,
+	.flags =	ZIO_BUF_FLAG_SINGLE, /* one slot reserved at a time */
+	.zattr_set = {
+		.std_zattr = zbk_std_zattr,
+	},
+	.s_op = &zbk_sysfs_ops,
+	.b_op = &zbk_buffer_ops,
+	.v_op = &zbk_vma_ops,
+	.f_op = &zio_generic_file_operations,
+};
+
+static int __init zbk_init(void)
+{
+	return zio_register_buf(&zbk_buffer, "ring");
+}
+
+static void __exit zbk_exit(void)
+{
+	zio_unregister_buf(&zbk_buffer);
+}
+
+module_init(zbk_init);
+module_exit(zbk_exit);
+MODULE_AUTHOR("Federico Vaga");
+MODULE_VERSION(GIT_VERSION); /* Defined in local Makefile */
+MODULE_LICENSE("GPL");
+
+ADDITIONAL_VERSIONS;
@@ -18,8 +18,10 @@
 #include <linux/err.h>
 #include <linux/fs.h>
 #include <linux/vmalloc.h>
+#include <linux/log2.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
@@ -31,19 +33,49 @@
 #define	address_of(vmf)	((vmf)->virtual_address)
 #endif
 
+/* The highest order alloc_pages() accepts, and how to insist on it */
+#if KERNEL_VERSION(6, 8, 0) <= LINUX_VERSION_CODE
+#define ZBK_MAX_ORDER	MAX_PAGE_ORDER
+#elif KERNEL_VERSION(6, 4, 0) <= LINUX_VERSION_CODE
+#define ZBK_MAX_ORDER	MAX_ORDER
+#else
+#define ZBK_MAX_ORDER	(MAX_ORDER - 1)
+#endif
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+#define ZBK_GFP_RETRY	__GFP_RETRY_MAYFAIL
+#else
+#define ZBK_GFP_RETRY	__GFP_REPEAT
+#endif
+
 /*
  * We export a linear buffer to user space, for a single mmap call.
  * The circular buffer is managed by the ZIO first-fit allocator
  */
+struct zbk_area {
+	struct list_head list; /* in the retired list, if replaced */
+	struct zio_ffa *ffa;
+	struct zio_cba *cba;
+	void *data;
+	struct page *pages; /* if data is physically contiguous */
+	unsigned long size;
+	unsigned int nblocks; /* allocated from here, under bi->lock */
+};
+
 struct zbk_instance {
 	struct zio_bi bi;
 	struct list_head list; /* items, one per block */
-	struct zio_ffa *ffa;
-	void *data;
+	struct zbk_area *area; /* where new blocks are allocated */
+	struct list_head retired; /* older areas, until their blocks go */
+	struct work_struct work;
+	unsigned long req_size; /* requested area, for the work */
+	int req_circular, req_contiguous;
 	atomic_t map_count;
-	unsigned long size;
 	unsigned long alloc_size; /* allocated size */
 	unsigned long flags;
+	/* optional ring of controls, mapped on the ctrl cdev */
+	struct zio_ring_header *cring;
+	unsigned long cring_size;
+	unsigned int req_cring, cur_cring; /* "ctrl-ring" values, for work */
 };
 #define to_zbki(bi) container_of(bi, struct zbk_instance, bi)
 
@@ -57,13 +89,23 @@ struct zbk_item {
 	struct zio_block block;
 	struct list_head list;	/* item list */
 	struct zbk_instance *instance;
+	struct zbk_area *area;
 	unsigned long begin;
 	size_t len; /* block.datalen may change, so save this */
+	struct zio_ring_header *cring; /* where it is published, if any */
+	uint32_t ridx; /* index in the control ring */
 };
 #define to_item(block) container_of(block, struct zbk_item, block);
 
 enum {
 	ZBK_ATTR_MERGE_DATA = ZIO_MAX_STD_ATTR,
+	ZBK_ATTR_CTRL_RING,
+	ZBK_ATTR_ALLOCATOR,
+	ZBK_ATTR_ALLOC_WRAPS,
+	ZBK_ATTR_ALLOC_WASTE,
+	ZBK_ATTR_ALLOC_UNORDERED,
+	ZBK_ATTR_CONTIGUOUS,
+	ZBK_ATTR_MMAP_OUTPUT,
 };
 
 static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
@@ -76,76 +118,395 @@ static ZIO_ATTR_DEFINE_STD(ZIO_BUF, zbk_std_zattr) = {
 static struct zio_attribute zbk_ext_attr[] = {
 	ZIO_ATTR_EXT("merge-data", ZIO_RW_PERM,
 		     ZBK_ATTR_MERGE_DATA, 0),
+	ZIO_PARAM_EXT("ctrl-ring", ZIO_RW_PERM,
+		     ZBK_ATTR_CTRL_RING, 0),
+	/* 0: first-fit, 1: circular; the statistics are for the latter */
+	ZIO_PARAM_EXT("allocator", ZIO_RW_PERM,
+		     ZBK_ATTR_ALLOCATOR, 0),
+	ZIO_PARAM_EXT("alloc-wraps", ZIO_RO_PERM,
+		     ZBK_ATTR_ALLOC_WRAPS, 0),
+	ZIO_PARAM_EXT("alloc-waste", ZIO_RO_PERM,
+		     ZBK_ATTR_ALLOC_WASTE, 0),
+	ZIO_PARAM_EXT("alloc-unordered", ZIO_RO_PERM,
+		     ZBK_ATTR_ALLOC_UNORDERED, 0),
+	/* 1: one high-order allocation, mapped in full by mmap() */
+	ZIO_PARAM_EXT("contiguous", ZIO_RW_PERM,
+		     ZBK_ATTR_CONTIGUOUS, 0),
+	/* 1: output data is filled in the map, writing the control commits */
+	ZIO_PARAM_EXT("mmap-output", ZIO_RW_PERM,
+		     ZBK_ATTR_MMAP_OUTPUT, 0),
 };
 
+/*
+ * The control ring: a struct zio_ring_header followed by a power-of-two
+ * number of controls. Stored input blocks are published there, so the
+ * ctrl cdev can be mapped; the reader tells us which blocks are consumed
+ * by writing tail, and we release them lazily (see zbk_reclaim()).
+ */
+static struct zio_ring_header *zbk_cring_create(unsigned int n,
+						unsigned long *size)
+{
+	struct zio_ring_header *cring;
+
+	n = roundup_pow_of_two(n);
+	*size = PAGE_ALIGN(PAGE_SIZE + n * __ZIO_CONTROL_SIZE);
+	cring = vmalloc_user(*size);
+	if (!cring)
+		return NULL;
+	cring->nslots = n;
+	cring->ctrl_offset = PAGE_SIZE;
+	return cring;
+}
+
+static struct zio_control *zbk_cring_slot(struct zio_ring_header *cring,
+					  uint32_t idx)
+{
+	return (void *)cring + cring->ctrl_offset
+		+ (idx & (cring->nslots - 1)) * __ZIO_CONTROL_SIZE;
+}
+
+static void zbk_free_block(struct zio_bi *bi, struct zio_block *block);
+
+/* Release the blocks whose control the mmap reader has consumed */
+static void zbk_reclaim(struct zbk_instance *zbki)
+{
+	struct zio_bi *bi = &zbki->bi;
+	struct zbk_item *item;
+	unsigned long flags;
+	uint32_t tail;
+
+	if (!zbki->cring)
+		return;
+	tail = READ_ONCE(zbki->cring->tail);
+	spin_lock_irqsave(&bi->lock, flags);
+	while (!list_empty(&zbki->list)) {
+		item = list_first_entry(&zbki->list, struct zbk_item, list);
+		if (!item->cring || (int)(tail - item->ridx) <= 0)
+			break;
+		list_del(&item->list);
+		atomic_dec(&bi->nready);
+		item->cring = NULL;
+		spin_unlock_irqrestore(&bi->lock, flags);
+		zbk_free_block(bi, &item->block);
+		spin_lock_irqsave(&bi->lock, flags);
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+}
+
+/*
+ * With a control ring, blocks already consumed through the map are still
+ * in the list until zbk_reclaim() runs: poll must not count them.
+ */
+static unsigned int zbk_nready(struct zio_bi *bi)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned int n = atomic_read(&bi->nready);
+	unsigned long flags;
+	uint32_t pending;
+
+	if (!READ_ONCE(zbki->cring))
+		return n;
+	/* The lock keeps the ring from being replaced under us */
+	spin_lock_irqsave(&bi->lock, flags);
+	if (zbki->cring) {
+		pending = zbki->cring->head - READ_ONCE(zbki->cring->tail);
+		if (pending > zbki->cring->nslots)
+			n = 0; /* tail is not ours to trust */
+		else
+			n = min(n, pending);
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+	return n;
+}
+
+/* The current area: zbk_work() calls bi->area_change when replacing it */
+static int zbk_area(struct zio_bi *bi, void **base, size_t *size)
+{
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned long flags;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	*base = zbki->area->data;
+	*size = zbki->area->size;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	return 0;
+}
+
+/*
+ * The data area is managed either by the first-fit allocator or, for
+ * buffers that are consumed in order, by the circular bump allocator.
+ * The latter needs a fixed number of records, one per block in flight.
+ */
+#define ZBK_CBA_NREC(size) clamp_t(unsigned long, (size) / 256, 64, 16384)
+
+/*
+ * The area is vmalloc'd by default. A contiguous area is a single
+ * compound high-order allocation instead: user space gets it in one go
+ * by remap_pfn_range() at mmap time, so there are no page faults (the
+ * mapping still uses small pages: this saves faults, not TLB entries).
+ * Its size is capped by the page allocator (ZBK_MAX_ORDER); within the
+ * cap we let reclaim and compaction try hard, so the caller must be
+ * able to sleep.
+ */
+static struct zbk_area *zbk_area_create(unsigned long size, int circular,
+					int contiguous, int node, gfp_t gfp)
+{
+	struct zbk_area *area;
+
+	area = kzalloc_node(sizeof(*area), gfp, node);
+	if (!area)
+		return NULL;
+	area->size = size;
+	if (contiguous && get_order(size) > ZBK_MAX_ORDER) {
+		area->data = NULL; /* too big for the page allocator */
+	} else if (contiguous) {
+		area->pages = alloc_pages_node(node, gfp | __GFP_COMP |
+					       __GFP_NOWARN | ZBK_GFP_RETRY,
+					       get_order(size));
+		if (area->pages)
+			area->data = page_address(area->pages);
+	} else {
+		area->data = vmalloc_node(size, node);
+	}
+	if (circular)
+		area->cba = zio_cba_create(0, size, ZBK_CBA_NREC(size));
+	else
+		area->ffa = zio_ffa_create(0, size);
+	if (area->data && (area->ffa || area->cba))
+		return area;
+	zio_ffa_destroy(area->ffa);
+	zio_cba_destroy(area->cba);
+	if (area->pages)
+		__free_pages(area->pages, get_order(size));
+	else
+		vfree(area->data);
+	kfree(area);
+	return NULL;
+}
+
+static void zbk_area_destroy(struct zbk_area *area)
+{
+	zio_ffa_destroy(area->ffa);
+	zio_cba_destroy(area->cba);
+	if (area->pages)
+		__free_pages(area->pages, get_order(area->size));
+	else
+		vfree(area->data);
+	kfree(area);
+}
+
+static unsigned long zbk_data_alloc(struct zbk_area *area, size_t len,
+				    gfp_t gfp)
+{
+	if (area->cba)
+		return zio_cba_alloc(area->cba, len);
+	return zio_ffa_alloc(area->ffa, len, gfp);
+}
+
+static void zbk_data_free(struct zbk_area *area, unsigned long begin,
+			  size_t len)
+{
+	if (area->cba)
+		zio_cba_free_s(area->cba, begin, len);
+	else
+		zio_ffa_free_s(area->ffa, begin, len);
+}
+
+/* Called with bi->lock held, when a block leaves its area */
+static void __zbk_area_put(struct zbk_instance *zbki, struct zbk_area *area)
+{
+	if (!--area->nblocks && area != zbki->area)
+		schedule_work(&zbki->work); /* retired and drained */
+}
+
+/*
+ * The control ring is replaced by the work too. Published indexes refer
+ * to the old ring, so the new one starts empty, with no stored block.
+ */
+static void zbk_cring_work(struct zbk_instance *zbki)
+{
+	struct zio_bi *bi = &zbki->bi;
+	struct zio_ring_header *cring = NULL;
+	unsigned long flags, size = 0;
+	unsigned int n;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	n = zbki->req_cring;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (n == zbki->cur_cring)
+		return;
+	if (n) {
+		cring = zbk_cring_create(n, &size);
+		if (!cring)
+			dev_err(&bi->head.dev, "can't allocate ctrl-ring\n");
+	}
+
+	spin_lock_irqsave(&bi->lock, flags);
+	if ((n && !cring) || atomic_read(&zbki->map_count) ||
+	    !list_empty(&zbki->list)) {
+		/* sysfs goes back to the ring in use */
+		bi->zattr_set.ext_zattr[ZBK_ATTR_CTRL_RING -
+					ZIO_MAX_STD_ATTR].value =
+			zbki->cur_cring;
+		zbki->req_cring = zbki->cur_cring;
+		spin_unlock_irqrestore(&bi->lock, flags);
+		vfree(cring);
+		return;
+	}
+	swap(cring, zbki->cring);
+	zbki->cring_size = size;
+	zbki->cur_cring = n;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	vfree(cring);
+}
+
+/* If the replacement failed, sysfs goes back to the area in use */
+static void __zbk_revert(struct zbk_instance *zbki)
+{
+	struct zio_attribute_set *zset = &zbki->bi.zattr_set;
+	struct zbk_area *area = zbki->area;
+
+	zset->std_zattr[ZIO_ATTR_ZBUF_MAXKB].value = area->size / 1024;
+	zset->ext_zattr[ZBK_ATTR_ALLOCATOR - ZIO_MAX_STD_ATTR].value =
+		!!area->cba;
+	zset->ext_zattr[ZBK_ATTR_CONTIGUOUS - ZIO_MAX_STD_ATTR].value =
+		!!area->pages;
+	zbki->req_size = area->size;
+	zbki->req_circular = !!area->cba;
+	zbki->req_contiguous = !!area->pages;
+}
+
+/*
+ * Size and allocator changes are applied here, in process context. New
+ * blocks are allocated from the new area at once, while the old one
+ * stays on the retired list until its last block is released: nothing
+ * is flushed and the trigger keeps running. The same work releases
+ * drained areas, as blocks are freed in atomic context.
+ */
+static void zbk_work(struct work_struct *work)
+{
+	struct zbk_instance *zbki = container_of(work, struct zbk_instance,
+						 work);
+	struct zio_bi *bi = &zbki->bi;
+	struct zbk_area *area = NULL, *tmp;
+	unsigned long flags, size;
+	int circular, contiguous, change, replaced;
+	LIST_HEAD(drained);
+
+	zbk_cring_work(zbki);
+
+	spin_lock_irqsave(&bi->lock, flags);
+	size = zbki->req_size;
+	circular = zbki->req_circular;
+	contiguous = zbki->req_contiguous;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	change = size != zbki->area->size || circular != !!zbki->area->cba ||
+		contiguous != !!zbki->area->pages;
+	if (change) {
+		area = zbk_area_create(size, circular, contiguous, bi->node,
+				       GFP_KERNEL);
+		if (!area)
+			dev_err(&bi->head.dev, "can't allocate %lu bytes\n",
+				size);
+	}
+
+	spin_lock_irqsave(&bi->lock, flags);
+	if (area && atomic_read(&zbki->map_count)) {
+		list_add(&area->list, &drained); /* can't change under mmap */
+		area = NULL;
+	}
+	replaced = !!area;
+	if (area) {
+		list_add(&zbki->area->list, &zbki->retired);
+		zbki->area = area;
+		bi->flags &= ~ZIO_BI_NOSPACE;
+	} else if (change) {
+		__zbk_revert(zbki);
+	}
+	list_for_each_entry_safe(area, tmp, &zbki->retired, list)
+		if (!area->nblocks)
+			list_move(&area->list, &drained);
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	/* Writers may be waiting for space */
+	wake_up_interruptible(&bi->q);
+
+	/* Drivers mapping the old area drop it now, before it is freed */
+	if (replaced && bi->area_change)
+		bi->area_change(bi);
+
+	list_for_each_entry_safe(area, tmp, &drained, list) {
+		list_del(&area->list);
+		zbk_area_destroy(area);
+	}
+}
+
+/* conf_set is called in atomic context: area changes are deferred */
 static int zbk_conf_set(struct device *dev, struct zio_attribute *zattr,
 		uint32_t  usr_val)
 {
 	struct zio_bi *bi = to_zio_bi(dev);
-	struct zio_ti *ti = NULL;
 	struct zbk_instance *zbki = to_zbki(bi);
-	struct zio_block *block;
-	unsigned long flags, bflags, tflags;
-	void *data;
-	int ret = 0;
+	unsigned long flags;
 
 	switch (zattr->id) {
 	case ZIO_ATTR_ZBUF_MAXKB:
+	case ZBK_ATTR_ALLOCATOR:
+	case ZBK_ATTR_CONTIGUOUS:
 		if (usr_val == zattr->value)
 			return 0; /* nothing to do */
-		/* Lock and disable */
+		if (zattr->id == ZIO_ATTR_ZBUF_MAXKB && !usr_val)
+			return -EINVAL;
 		spin_lock_irqsave(&bi->lock, flags);
+		/* mem_offset of the mapped blocks refers to one area */
 		if (atomic_read(&zbki->map_count)) {
 			spin_unlock_irqrestore(&bi->lock, flags);
 			return -EBUSY;
 		}
-		bflags = bi->flags;
-		bi->flags |= ZIO_DISABLED;
+		if (zattr->id == ZIO_ATTR_ZBUF_MAXKB)
+			zbki->req_size = usr_val * 1024;
+		else if (zattr->id == ZBK_ATTR_ALLOCATOR)
+			zbki->req_circular = !!usr_val;
+		else
+			zbki->req_contiguous = !!usr_val;
 		spin_unlock_irqrestore(&bi->lock, flags);
+		schedule_work(&zbki->work);
+		break;
 
-		/*
-		 * Disable trigger while resizing buffer to avoid
-		 * problems with blocks that point to a different
-		 * vmalloc() area
-		 */
-		ti = bi->cset->ti;
-		tflags = zio_trigger_abort_disable(ti->cset, 1);
-
-		/* Flush the buffer */
-		while ((block = bi->b_op->retr_block(bi)))
-			bi->b_op->free_block(bi, block);
-
-		/* Change size */
-		data = vmalloc(usr_val * 1024);
-		if (data) {
-			vfree(zbki->data);
-			zio_ffa_destroy(zbki->ffa);
-			zbki->ffa = zio_ffa_create(0, usr_val * 1024);
-			/* FIXME: what if this malloc failed? */
-			zbki->size = usr_val * 1024;
-			zbki->data = data;
-		} else {
-			ret = -ENOMEM;
-		}
+	case ZBK_ATTR_MERGE_DATA:
+		if (usr_val)
+			zbki->flags |= ZBK_FLAG_MERGE_DATA;
+		else
+			zbki->flags &= ~ZBK_FLAG_MERGE_DATA;
+		break;
 
-		/* Lock and restore flags */
+	case ZBK_ATTR_CTRL_RING:
+		if (usr_val == zattr->value)
+			return 0; /* nothing to do */
+		if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+			return -EINVAL; /* controls flow towards user space */
+		/* Checked again by the work, that allocates the ring */
 		spin_lock_irqsave(&bi->lock, flags);
-		bi->flags = bflags;
+		if (atomic_read(&zbki->map_count) ||
+		    !list_empty(&zbki->list)) {
+			spin_unlock_irqrestore(&bi->lock, flags);
+			return -EBUSY;
+		}
+		zbki->req_cring = usr_val;
 		spin_unlock_irqrestore(&bi->lock, flags);
+		schedule_work(&zbki->work);
+		break;
 
-		/* Restore trigger */
-		if (ti && ((tflags & ZIO_STATUS) == ZIO_ENABLED))
-			ti->flags = (ti->flags & ~ZIO_STATUS) | ZIO_ENABLED;
-		if (ti && (tflags & ZIO_TI_ARMED))
-			zio_arm_trigger(ti);
-
-		return ret;
-
-	case ZBK_ATTR_MERGE_DATA:
+	case ZBK_ATTR_MMAP_OUTPUT:
+		if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT)
+			return -EINVAL;
+		spin_lock_irqsave(&bi->lock, flags);
 		if (usr_val)
-			zbki->flags |= ZBK_FLAG_MERGE_DATA;
+			bi->flags |= ZIO_BI_MMAP_OUTPUT;
 		else
-			zbki->flags &= ~ZBK_FLAG_MERGE_DATA;
+			bi->flags &= ~ZIO_BI_MMAP_OUTPUT;
+		spin_unlock_irqrestore(&bi->lock, flags);
 		break;
 	default:
 		return -EINVAL;
@@ -158,11 +519,27 @@ static int zbk_info_get(struct device *dev, struct zio_attribute *zattr,
 {
 	struct zio_bi *bi = to_zio_bi(dev);
 	struct zbk_instance *zbki = to_zbki(bi);
+	struct zio_cba_stats stats = {0,};
+	unsigned long flags;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	if (zbki->area->cba)
+		zio_cba_stats(zbki->area->cba, &stats);
+	spin_unlock_irqrestore(&bi->lock, flags);
 
 	switch (zattr->id) {
 	case ZIO_ATTR_ZBUF_ALLOC_KB:
 		*usr_val = zbki->alloc_size / 1024;
 		break;
+	case ZBK_ATTR_ALLOC_WRAPS:
+		*usr_val = stats.wraps;
+		break;
+	case ZBK_ATTR_ALLOC_WASTE:
+		*usr_val = stats.waste;
+		break;
+	case ZBK_ATTR_ALLOC_UNORDERED:
+		*usr_val = stats.unordered;
+		break;
 	case ZIO_ATTR_ZBUF_MAXKB:
 	default:
 		break;
@@ -181,21 +558,32 @@ static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
 {
 	struct zbk_instance *zbki = to_zbki(bi);
 	struct zbk_item *item;
+	struct zbk_area *area;
 	struct zio_control *ctrl;
 	unsigned long offset, flags;
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
+	/* make room for this block, if the mmap reader consumed some */
+	zbk_reclaim(zbki);
+
+	/* pin the current area, it may be replaced meanwhile */
+	spin_lock_irqsave(&bi->lock, flags);
+	area = zbki->area;
+	area->nblocks++;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
 	/* alloc item and data. Control remains null at this point */
-	item = kmem_cache_alloc(zbk_slab, gfp);
-	offset = zio_ffa_alloc(zbki->ffa, datalen, gfp);
-	ctrl = zio_alloc_control(gfp);
+	item = kmem_cache_alloc_node(zbk_slab, gfp, bi->node);
+	offset = zbk_data_alloc(area, datalen, gfp);
+	ctrl = zio_alloc_control_node(gfp, bi->node);
 	if (!item || !ctrl || offset == ZIO_FFA_NOSPACE)
 		goto out_free;
 	memset(item, 0, sizeof(*item));
+	item->area = area;
 	item->begin = offset;
 	item->len = datalen;
-	item->block.data = zbki->data + offset;
+	item->block.data = area->data + offset;
 	item->block.datalen = datalen;
 	item->instance = zbki;
 
@@ -204,19 +592,20 @@ static struct zio_block *zbk_alloc_block(struct zio_bi *bi,
 	spin_unlock_irqrestore(&bi->lock, flags);
 	/* mem_offset in current_ctrl is the last allocated */
 	bi->chan->current_ctrl->mem_offset = offset;
+	ctrl->mem_offset = offset; /* for mmap-output writers */
 	zio_set_ctrl(&item->block, ctrl);
 	return &item->block;
 
 out_free:
-	if (offset != ZIO_FFA_NOSPACE) {
-		zio_ffa_free_s(zbki->ffa, offset, datalen);
-	} else {
-		/* NOSPACE means that the buffer is 'full', there is
-		 * no space for the requested datalen */
-		spin_lock_irqsave(&bi->lock, flags);
-	  	bi->flags |= ZIO_BI_NOSPACE;
-		spin_unlock_irqrestore(&bi->lock, flags);
-	}
+	if (offset != ZIO_FFA_NOSPACE)
+		zbk_data_free(area, offset, datalen);
+	spin_lock_irqsave(&bi->lock, flags);
+	/* NOSPACE means that the buffer is 'full', there is
+	 * no space for the requested datalen */
+	if (offset == ZIO_FFA_NOSPACE && area == zbki->area)
+		bi->flags |= ZIO_BI_NOSPACE;
+	__zbk_area_put(zbki, area);
+	spin_unlock_irqrestore(&bi->lock, flags);
 	kmem_cache_free(zbk_slab, item);
 	zio_free_control(ctrl);
 	return NULL;
@@ -238,16 +627,23 @@ static void zbk_free_block(struct zio_bi *bi, struct zio_block *block)
 	if (bi->flags & ZIO_BI_PUSHING) {
 		/* freed while pushing: we hold the bi lock already */
 		zbki->alloc_size -= item->len;
+		zbk_data_free(item->area, item->begin, item->len);
+		__zbk_area_put(zbki, item->area);
 		goto out_free;
 	}
 
+	/* consumed by read(): keep the mmap view of the ring coherent */
+	if (item->cring && item->cring == zbki->cring)
+		cmpxchg(&item->cring->tail, item->ridx, item->ridx + 1);
+
+	zbk_data_free(item->area, item->begin, item->len);
 	spin_lock_irqsave(&bi->lock, flags);
 	zbki->alloc_size -= item->len;
 	bi->flags &= ~ZIO_BI_NOSPACE;
+	__zbk_area_put(zbki, item->area);
 	spin_unlock_irqrestore(&bi->lock, flags);
 
 out_free:
-	zio_ffa_free_s(zbki->ffa, item->begin, item->len);
 	zio_free_control(ctrl);
 	kmem_cache_free(zbk_slab, item);
 }
@@ -260,35 +656,64 @@ static void zbk_try_merge(struct zbk_instance *zbki, struct zbk_item *item)
 
 	/* Called while locked and already part of the list */
 	prev = list_entry(item->list.prev, struct zbk_item, list);
-	if (prev->begin + prev->len != item->begin)
+	if (prev->area != item->area || prev->begin + prev->len != item->begin)
 		return; /* no, thanks */
 
 	/* merge: remove from list, fix prev block, remove new control */
 	list_del(&item->list);
+	atomic_dec(&zbki->bi.nready);
 	ctrl = zio_get_ctrl(&item->block);
 	prevc = zio_get_ctrl(&prev->block);
 
 	prev->len += item->len;				/* for the allocator */
 	prev->block.datalen += item->block.datalen;	/* for copying */
 	prevc->nsamples += ctrl->nsamples;		/* meta information */
+	item->area->nblocks--;				/* prev still holds it */
 
 	zio_free_control(ctrl);
 	kmem_cache_free(zbk_slab, item);
 }
 
+/*
+ * The control ring is full: with PREF_NEW the oldest stored block makes
+ * room for the new one, unless read() already took it. The caller frees
+ * the item after unlocking. Called with bi->lock held.
+ */
+static struct zbk_item *zbk_cring_drop(struct zbk_instance *zbki)
+{
+	struct zio_ring_header *cring = zbki->cring;
+	struct zbk_item *item;
+	uint32_t tail = READ_ONCE(cring->tail);
+
+	if (!(zbki->bi.flags & ZIO_BI_PREF_NEW) || list_empty(&zbki->list))
+		return NULL;
+	item = list_first_entry(&zbki->list, struct zbk_item, list);
+	if (item->cring != cring || item->ridx != tail)
+		return NULL;
+	if (cmpxchg(&cring->tail, tail, tail + 1) != tail)
+		return NULL; /* the mmap reader released it meanwhile */
+	list_del(&item->list);
+	atomic_dec(&zbki->bi.nready);
+	item->cring = NULL;
+	return item;
+}
+
 /* Store is called by the trigger (for input) or by f->write (for output) */
 static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
 {
 	struct zbk_instance *zbki = to_zbki(bi);
 	struct zio_channel *chan = bi->chan;
-	struct zbk_item *item;
+	struct zbk_item *item, *dropped = NULL;
 	unsigned long flags;
+	uint32_t head;
+	size_t datalen;
 	int awake = 0, pushed = 0, output, first;
 
 	pr_debug("%s:%d (%p, %p)\n", __func__, __LINE__, bi, block);
 
 	item = to_item(block);
 	zio_get_ctrl(block)->mem_offset = item->begin;
+	datalen = block->datalen; /* merging may change the block */
 
 	output = (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT;
 
@@ -301,16 +726,41 @@ static int zbk_store_block(struct zio_bi *bi, struct zio_block *block)
 		else
 			awake = 1;
 	}
-	if (!pushed)
+	if (!pushed && zbki->cring) {
+		/* publish the control; merging would change it later */
+		head = zbki->cring->head;
+		if (head - READ_ONCE(zbki->cring->tail) >=
+		    zbki->cring->nslots) {
+			dropped = zbk_cring_drop(zbki);
+			if (dropped)
+				zio_get_ctrl(block)->zio_alarms |=
+					ZIO_ALARM_LOST_BLOCK;
+		}
+		if (head - READ_ONCE(zbki->cring->tail) >=
+		    zbki->cring->nslots) {
+			spin_unlock_irqrestore(&bi->lock, flags);
+			return -ENOSPC;
+		}
+		memcpy(zbk_cring_slot(zbki->cring, head), zio_get_ctrl(block),
+		       __ZIO_CONTROL_SIZE);
+		item->ridx = head;
+		item->cring = zbki->cring;
+		smp_store_release(&zbki->cring->head, head + 1);
+	}
+	if (!pushed) {
 		list_add_tail(&item->list, &zbki->list);
+		atomic_inc(&bi->nready);
+	}
 
-	if (!first && zbki->flags & ZBK_FLAG_MERGE_DATA)
+	if (!first && !zbki->cring && zbki->flags & ZBK_FLAG_MERGE_DATA)
 		zbk_try_merge(zbki, item);
 	spin_unlock_irqrestore(&bi->lock, flags);
+	if (dropped)
+		zbk_free_block(bi, &dropped->block);
 
-	/* if first input, awake user space */
-	if (awake)
-		wake_up_interruptible(&bi->q);
+	/* awake user space, if it waited for this block */
+	if (!output)
+		zio_bi_wake_reader(bi, datalen, awake);
 	return 0;
 }
 
@@ -330,6 +780,9 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 	if (bi->flags & ZIO_BI_PUSHING)
 		return NULL;
 
+	/* don't return what the mmap reader already consumed */
+	zbk_reclaim(zbki);
+
 	/* There is no trig->push in our call trace, proceed to get the lock */
 	spin_lock_irqsave(&bi->lock, flags);
 	if (list_empty(&zbki->list))
@@ -337,6 +790,7 @@ static struct zio_block *zbk_retr_block(struct zio_bi *bi)
 	first = zbki->list.next;
 	item = list_entry(first, struct zbk_item, list);
 	list_del(&item->list);
+	atomic_dec(&bi->nready);
 	awake = 1;
 	spin_unlock_irqrestore(&bi->lock, flags);
 
@@ -363,10 +817,11 @@ out_unlock:
 static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
 				 struct zio_channel *chan)
 {
+	struct zio_attribute *ext = zbuf->zattr_set.ext_zattr;
 	struct zbk_instance *zbki;
-	struct zio_ffa *ffa;
-	void *data;
+	struct zbk_area *area;
 	size_t size;
+	int node;
 
 	pr_debug("%s:%d\n", __func__, __LINE__);
 
@@ -376,30 +831,66 @@ static struct zio_bi *zbk_create(struct zio_buffer_type *zbuf,
 
 	size = 1024 * zbuf->zattr_set.std_zattr[ZIO_ATTR_ZBUF_MAXKB].value;
 
-	zbki = kzalloc(sizeof(*zbki), GFP_ATOMIC);
-	ffa = zio_ffa_create(0, size);
-	data = vmalloc(size);
-	if (!zbki || !ffa || !data)
+	node = zio_chan_to_node(chan);
+	zbki = kzalloc_node(sizeof(*zbki), GFP_KERNEL, node);
+	area = zbk_area_create(size,
+			ext[ZBK_ATTR_ALLOCATOR - ZIO_MAX_STD_ATTR].value,
+			ext[ZBK_ATTR_CONTIGUOUS - ZIO_MAX_STD_ATTR].value,
+			node, GFP_KERNEL);
+	if (!zbki || !area)
 		goto out_nomem;
-	zbki->size = size;
-	zbki->ffa = ffa;
-	zbki->data = data;
+	zbki->area = area;
+	zbki->req_size = size;
+	zbki->req_circular = !!area->cba;
+	zbki->req_contiguous = !!area->pages;
 	INIT_LIST_HEAD(&zbki->list);
+	INIT_LIST_HEAD(&zbki->retired);
+	INIT_WORK(&zbki->work, zbk_work);
 
 	/* all the fields of zio_bi are initialied by the caller */
 	return &zbki->bi;
 out_nomem:
 	kfree(zbki);
-	zio_ffa_destroy(ffa);
-	if (data)
-		vfree(data);
+	if (area)
+		zbk_area_destroy(area);
 	return ERR_PTR(-ENOMEM);
 }
 
+/* A contiguous data area is mapped at once, the rest is faulted in */
+static int zbk_mmap(struct zio_bi *bi, struct vm_area_struct *vma)
+{
+	struct zio_f_priv *priv = vma->vm_file->private_data;
+	struct zbk_instance *zbki = to_zbki(bi);
+	unsigned long len = vma->vm_end - vma->vm_start;
+	struct zbk_area *area;
+	unsigned long flags;
+	int retired;
+
+	if (priv->type != ZIO_CDEV_DATA)
+		return 0;
+	/* the area can't change any more, as we are counted in map_count */
+	spin_lock_irqsave(&bi->lock, flags);
+	area = zbki->area;
+	retired = !list_empty(&zbki->retired);
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (retired)
+		return -EBUSY; /* some mem_offset refers to an old area */
+
+	if (!area->pages)
+		return 0;
+	if (vma->vm_pgoff + (len >> PAGE_SHIFT) >
+	    PAGE_ALIGN(area->size) >> PAGE_SHIFT)
+		return -EINVAL;
+	return remap_pfn_range(vma, vma->vm_start,
+			       page_to_pfn(area->pages) + vma->vm_pgoff,
+			       len, vma->vm_page_prot);
+}
+
 /* destroy is called by zio on channel removal or if it changes buffer type */
 static void zbk_destroy(struct zio_bi *bi)
 {
 	struct zbk_instance *zbki = to_zbki(bi);
+	struct zbk_area *area, *tmp_area;
 	struct zbk_item *item;
 	struct list_head *pos, *tmp;
 
@@ -410,8 +901,11 @@ static void zbk_destroy(struct zio_bi *bi)
 		item = list_entry(pos, struct zbk_item, list);
 		zbk_free_block(&zbki->bi, &item->block);
 	}
-	vfree(zbki->data);
-	zio_ffa_destroy(zbki->ffa);
+	cancel_work_sync(&zbki->work);
+	list_for_each_entry_safe(area, tmp_area, &zbki->retired, list)
+		zbk_area_destroy(area);
+	zbk_area_destroy(zbki->area);
+	vfree(zbki->cring);
 	kfree(zbki);
 }
 
@@ -422,12 +916,14 @@ static const struct zio_buffer_operations zbk_buffer_ops = {
 	.retr_block =	zbk_retr_block,
 	.create =	zbk_create,
 	.destroy =	zbk_destroy,
+	.mmap =		zbk_mmap,
+	.nready =	zbk_nready,
+	.area =		zbk_area,
 };
 
 /*
- * To support mmap we implement the vm operations. We'll need
- * refcounting later, to safely change the buffer size (which we
- * refuse by now)
+ * To support mmap we implement the vm operations. The map count
+ * prevents size changes while user space sees the area.
  */
 static void zbk_open(struct vm_area_struct *vma)
 {
@@ -454,20 +950,33 @@ static int __zbk_fault(struct vm_fault *vmf, struct file *f)
 	struct zio_bi *bi = priv->chan->bi;
 	struct zbk_instance *zbki = to_zbki(bi);
 	long off = vmf->pgoff * PAGE_SIZE;
+	struct zbk_area *area;
 	struct page *p;
 	void *addr;
 
-	if (priv->type == ZIO_CDEV_CTRL)
-		return VM_FAULT_SIGBUS;
+	if (priv->type == ZIO_CDEV_CTRL) {
+		/* only the control ring, if any, can be mapped */
+		if (!zbki->cring || off >= zbki->cring_size)
+			return VM_FAULT_SIGBUS;
+		p = vmalloc_to_page((void *)zbki->cring + off);
+		get_page(p);
+		vmf->page = p;
+		return 0;
+	}
 
-	pr_debug("%s: fault at %li (size %li)\n", __func__, off, zbki->size);
-	if (off > zbki->size)
+	/* the area doesn't change while mapped */
+	area = zbki->area;
+	pr_debug("%s: fault at %li (size %li)\n", __func__, off, area->size);
+	if (off > area->size)
 		return VM_FAULT_SIGBUS;
 
-	addr = zbki->data + off;
+	addr = area->data + off;
 	pr_debug("%s: uaddr %p, off %li: kaddr %p\n", __func__,
 		 address_of(vmf), off, addr);
-	p = vmalloc_to_page(addr);
+	if (area->pages)
+		p = virt_to_page(addr);
+	else
+		p = vmalloc_to_page(addr);
 	get_page(p);
 	vmf->page = p;
 	return 0;
@@ -500,6 +1009,7 @@ static struct vm_operations_struct zbk_vma_ops = {
 
 static struct zio_buffer_type zbk_buffer = {
 	.owner =	THIS_MODULE,
+	.flags =	ZIO_BUF_FLAG_SPLICE,
 	.zattr_set = {
 		.std_zattr = zbk_std_zattr,
 		.ext_zattr = zbk_ext_attr,
@@ -96,10 +96,23 @@ static ssize_t zio_show_triggers(struct bus_type *bus, char *buf)
 	return len;
 }
 
+/*
+ * zio_show_ctrl_cache
+ * It shows hits and misses of the per-cpu control magazines
+ */
+static ssize_t zio_show_ctrl_cache(struct bus_type *bus, char *buf)
+{
+	unsigned long hits, misses;
+
+	zio_ctrl_cache_stats(&hits, &misses);
+	return sprintf(buf, "%lu %lu\n", hits, misses);
+}
+
 enum zio_bus_attributs_enumeration {
 	ZIO_DAN_BUS_VERSION,
 	ZIO_DAN_BUS_TRIGGERS,
 	ZIO_DAN_BUS_BUFFERS,
+	ZIO_DAN_BUS_CTRL_CACHE,
 };
 static struct bus_attribute def_bus_attrs[] = {
 	[ZIO_DAN_BUS_VERSION] = __ATTR(version, ZIO_RO_PERM,
@@ -108,6 +121,8 @@ static struct bus_attribute def_bus_attrs[] = {
 					zio_show_buffers, NULL),
 	[ZIO_DAN_BUS_BUFFERS] = __ATTR(available_triggers, ZIO_RO_PERM,
 					zio_show_triggers, NULL),
+	[ZIO_DAN_BUS_CTRL_CACHE] = __ATTR(ctrl_cache, ZIO_RO_PERM,
+					zio_show_ctrl_cache, NULL),
 	__ATTR_NULL,
 };
 
@@ -116,6 +131,7 @@ static struct attribute *zio_bus_def_attrs[] = {
 	&def_bus_attrs[ZIO_DAN_BUS_VERSION].attr,
 	&def_bus_attrs[ZIO_DAN_BUS_TRIGGERS].attr,
 	&def_bus_attrs[ZIO_DAN_BUS_BUFFERS].attr,
+	&def_bus_attrs[ZIO_DAN_BUS_CTRL_CACHE].attr,
 	NULL,
 };
 
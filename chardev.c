@@ -20,6 +20,8 @@
 #include <linux/sched/signal.h>
 #endif
 #include <linux/uaccess.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
 
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
@@ -45,6 +47,13 @@ static char *zio_devnode(struct device *dev, umode_t *mode)
 static char *zio_devnode(struct device *dev, mode_t *mode)
 #endif
 {
+	/* The gather device belongs to the cset, not to a channel */
+	if (to_zio_head(dev->parent)->zobj_type == ZIO_CSET)
+		return kasprintf(GFP_KERNEL, "zio/%s", dev_name(dev));
+
+	/* Keep combined devices apart, so "<name>*" still returns pairs */
+	if (MAJOR(dev->devt) == MAJOR(zstat->xbasedev))
+		return kasprintf(GFP_KERNEL, "zio/combined/%s", dev_name(dev));
 	return kasprintf(GFP_KERNEL, "zio/%s", dev_name(dev));
 }
 
@@ -60,22 +69,29 @@ static struct class zio_cdev_class = {
 	.devnode	= zio_devnode,
 };
 
-/* Retrieve a channel from one of its minors */
-static struct zio_channel *zio_minor_to_chan(int minor)
+/* Retrieve a cset from one of its minors */
+static struct zio_cset *zio_minor_to_cset(int minor)
 {
 	struct zio_cset *zcset;
-	int chindex, found = 0;
 
 	list_for_each_entry(zcset, &zstat->list_cset, list_cset) {
-		if (minor >= zcset->minor && minor <= zcset->maxminor) {
-			found = 1;
-			break;
-		}
+		if (minor >= zcset->minor && minor <= zcset->maxminor)
+			return zcset;
 	}
-	if (!found)
-		return NULL;
-	chindex = (minor - zcset->minor) / 2;
-	return zcset->chan + chindex;
+	return NULL;
+}
+
+/* Retrieve a cset from one of its minors in the extra region */
+static struct zio_cset *zio_xminor_to_cset(int minor)
+{
+	struct zio_cset *zcset;
+
+	list_for_each_entry(zcset, &zstat->list_cset, list_cset) {
+		if (minor >= zcset->xminor &&
+		    minor <= zcset->xminor + zcset->n_chan)
+			return zcset;
+	}
+	return NULL;
 }
 
 static inline int zio_channel_get(struct zio_channel *chan)
@@ -89,21 +105,120 @@ static inline void zio_channel_put(struct zio_channel *chan)
 	module_put(chan->cset->zdev->owner);
 }
 
-static int zio_f_open(struct inode *ino, struct file *f)
+/*
+ * Shared read: each consumer (an open file) has its own cursor, and
+ * blocks are kept in a channel list until all consumers have gone past
+ * them. A ctrl file consumes a block with its control, a data file with
+ * its data; to read both as a pair, use the combined cdev. Everything
+ * is protected by user_lock.
+ */
+struct zio_consumer {
+	struct list_head	list;
+	uint32_t		seq;	/* next shared block to read */
+	size_t			uoff;	/* data already read in that block */
+	int			cdone;	/* control already read (combined) */
+};
+
+struct zio_shared_block {
+	struct list_head	list;
+	struct zio_block	*block;
+	uint32_t		seq;
+	int			refs;	/* consumers still to read it */
+};
+
+static struct zio_consumer *zio_consumer_get(struct zio_channel *chan)
+{
+	struct zio_consumer *cons;
+
+	cons = kzalloc(sizeof(*cons), GFP_KERNEL);
+	if (!cons)
+		return ERR_PTR(-ENOMEM);
+	/* A new consumer starts from the next block */
+	mutex_lock(&chan->user_lock);
+	cons->seq = chan->shared_seq;
+	list_add_tail(&cons->list, &chan->consumers);
+	chan->n_consumers++;
+	mutex_unlock(&chan->user_lock);
+	return cons;
+}
+
+/* The consumer is done with this block, and it is the oldest it has */
+static void zio_shared_consume(struct zio_channel *chan,
+			       struct zio_consumer *cons,
+			       struct zio_shared_block *sb)
+{
+	cons->seq++;
+	cons->uoff = 0;
+	cons->cdone = 0;
+	if (--sb->refs)
+		return;
+	list_del(&sb->list);
+	zio_buffer_free_block(chan->bi, sb->block);
+	kfree(sb);
+}
+
+static void zio_consumer_put(struct zio_channel *chan,
+			     struct zio_consumer *cons)
+{
+	struct zio_shared_block *sb, *tmp;
+
+	mutex_lock(&chan->user_lock);
+	/* Release what this consumer didn't read */
+	list_for_each_entry_safe(sb, tmp, &chan->shared_blocks, list)
+		if ((int32_t)(sb->seq - cons->seq) >= 0)
+			zio_shared_consume(chan, cons, sb);
+	list_del(&cons->list);
+	chan->n_consumers--;
+	mutex_unlock(&chan->user_lock);
+	kfree(cons);
+}
+
+/*
+ * Return the block at the consumer's cursor, retrieving a new one from
+ * the buffer if the consumer is the first one to get there.
+ */
+static struct zio_shared_block *zio_shared_get(struct zio_f_priv *priv)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_shared_block *sb;
+
+	list_for_each_entry(sb, &chan->shared_blocks, list)
+		if (sb->seq == priv->cons->seq)
+			return sb;
+
+	sb = kmalloc(sizeof(*sb), GFP_KERNEL);
+	if (!sb)
+		return NULL;
+	sb->block = zio_buffer_retr_block(chan->bi);
+	if (!sb->block) {
+		kfree(sb);
+		return NULL;
+	}
+	sb->seq = chan->shared_seq;
+	sb->refs = chan->n_consumers;
+	list_add_tail(&sb->list, &chan->shared_blocks);
+	WRITE_ONCE(chan->shared_seq, chan->shared_seq + 1);
+	return sb;
+}
+
+static int zio_generic_release(struct inode *inode, struct file *f);
+static int zio_gather_open(struct zio_cset *cset, struct file *f);
+#if ZIO_HAS_ITER
+static ssize_t zio_generic_read_iter(struct kiocb *iocb, struct iov_iter *to);
+#endif
+
+static int __zio_f_open(struct inode *ino, struct file *f,
+			struct zio_channel *chan, enum zio_cdev_type type)
 {
 	struct zio_f_priv *priv = NULL;
-	struct zio_channel *chan;
 	struct zio_buffer_type *zbuf;
 	const struct file_operations *old_fops, *new_fops;
 	unsigned long flags;
-	int err, minor;
-
-	minor = iminor(ino);
-	chan = zio_minor_to_chan(minor);
+	int err;
 
 	if (!chan || !chan->bi || !zio_channel_get(chan)) {
 		pr_err("%s: no channel or no buffer for minor %i\n",
-			__func__, minor);
+			__func__, iminor(ino));
 		return -ENODEV;
 	}
 
@@ -121,12 +236,7 @@ static int zio_f_open(struct inode *ino, struct file *f)
 		goto out;
 	}
 	priv->chan = chan;
-
-	/* even number is control, odd number is data */
-	if (minor & 0x1)
-		priv->type = ZIO_CDEV_DATA;
-	else
-		priv->type = ZIO_CDEV_CTRL;
+	priv->type = type;
 
 	/* Change the file operations, locking the status structure */
 	mutex_lock(&zmutex);
@@ -146,6 +256,24 @@ static int zio_f_open(struct inode *ino, struct file *f)
 	mutex_unlock(&zmutex);
 
 	f->private_data = priv;
+#if ZIO_HAS_ITER && defined(FMODE_NOWAIT)
+	/* Our read_iter and write_iter honour IOCB_NOWAIT */
+	if (new_fops->read_iter == zio_generic_read_iter)
+		f->f_mode |= FMODE_NOWAIT;
+#endif
+
+	/* Only the generic operations know about consumers */
+	if ((chan->flags & ZIO_CHAN_SHARED_READ) &&
+	    (chan->flags & ZIO_DIR) == ZIO_DIR_INPUT &&
+	    new_fops->release == zio_generic_release) {
+		struct zio_consumer *cons = zio_consumer_get(chan);
+
+		if (IS_ERR(cons)) {
+			zio_generic_release(ino, f);
+			return PTR_ERR(cons);
+		}
+		priv->cons = cons;
+	}
 	return 0;
 
 out:
@@ -154,35 +282,80 @@ out:
 	return err;
 }
 
+/* even number is control, odd number is data */
+static int zio_f_open(struct inode *ino, struct file *f)
+{
+	struct zio_channel *chan = NULL;
+	struct zio_cset *cset;
+	int minor;
+
+	minor = iminor(ino);
+	cset = zio_minor_to_cset(minor);
+	if (cset)
+		chan = cset->chan + (minor - cset->minor) / ZIO_CHAN_MINORS;
+	return __zio_f_open(ino, f, chan,
+			    minor & 0x1 ? ZIO_CDEV_DATA : ZIO_CDEV_CTRL);
+}
+
+/* In the extra region: one combined minor per channel, then gather */
+static int zio_xf_open(struct inode *ino, struct file *f)
+{
+	struct zio_channel *chan = NULL;
+	struct zio_cset *cset;
+	int minor;
+
+	minor = iminor(ino);
+	cset = zio_xminor_to_cset(minor);
+	if (cset && minor == cset->xminor + cset->n_chan)
+		return zio_gather_open(cset, f);
+	if (cset)
+		chan = cset->chan + (minor - cset->xminor);
+	return __zio_f_open(ino, f, chan, ZIO_CDEV_COMBINED);
+}
+
 static const struct file_operations zfops = {
 	.owner = THIS_MODULE,
 	.open = zio_f_open,
 };
 
-/* set the base minor for a cset*/
+static const struct file_operations zxfops = {
+	.owner = THIS_MODULE,
+	.open = zio_xf_open,
+};
+
+/* set the base minor for a cset, and its extra minors */
 int zio_minorbase_get(struct zio_cset *zcset)
 {
-	unsigned long i;
-	int nminors = zcset->n_chan * 2;
+	unsigned long i, x;
+	int nminors = zcset->n_chan * ZIO_CHAN_MINORS;
 
 	zio_ffa_reset(zstat->minors); /* always start from zero */
 	i = zio_ffa_alloc(zstat->minors, nminors, GFP_ATOMIC);
 	if (i == ZIO_FFA_NOSPACE)
 		return -ENOMEM;
+	zio_ffa_reset(zstat->xminors);
+	x = zio_ffa_alloc(zstat->xminors, zcset->n_chan + 1, GFP_ATOMIC);
+	if (x == ZIO_FFA_NOSPACE) {
+		zio_ffa_free_s(zstat->minors, i, nminors);
+		return -ENOMEM;
+	}
 	zcset->minor = i;
 	zcset->maxminor = i + nminors - 1;
+	zcset->xminor = x;
 	return 0;
 }
 void zio_minorbase_put(struct zio_cset *zcset)
 {
-	int nminors = zcset->n_chan * 2;
+	int nminors = zcset->n_chan * ZIO_CHAN_MINORS;
 
 	zio_ffa_free_s(zstat->minors, zcset->minor, nminors);
+	zio_ffa_free_s(zstat->xminors, zcset->xminor, zcset->n_chan + 1);
 }
 
 /*
  * create control and data char devices for a channel. The even minor
- * is for control, the odd one for data.
+ * is for control, the odd one for data. Input channels also get the
+ * combined device, in the extra region.
  */
 int zio_create_chan_devices(struct zio_channel *chan)
 {
@@ -198,7 +371,8 @@ int zio_create_chan_devices(struct zio_channel *chan)
 	    !(chan->flags & ZIO_CSET_CHAN_INTERLEAVE))
 		return 0;
 
-	devt_c = zstat->basedev + chan->cset->minor + chan->index * 2;
+	devt_c = zstat->basedev + chan->cset->minor +
+		 chan->index * ZIO_CHAN_MINORS;
 	mask = chan->flags & ZIO_CSET_CHAN_INTERLEAVE ? "%s-%i-i-ctrl" :
 							"%s-%i-%i-ctrl";
 	chan->ctrl_dev = device_create(&zio_cdev_class, &chan->head.dev, devt_c,
@@ -224,8 +398,26 @@ int zio_create_chan_devices(struct zio_channel *chan)
 		goto out_data;
 	}
 
+	if ((chan->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return 0;
+	mask = chan->flags & ZIO_CSET_CHAN_INTERLEAVE ? "%s-%i-i-combined" :
+							"%s-%i-%i-combined";
+	chan->comb_dev = device_create(&zio_cdev_class, &chan->head.dev,
+			zstat->xbasedev + chan->cset->xminor + chan->index,
+			&chan->flags, mask,
+			dev_name(&chan->cset->zdev->head.dev),
+			chan->cset->index,
+			chan->index); /* ignored on interleave */
+	if (IS_ERR(chan->comb_dev)) {
+		err = PTR_ERR(chan->comb_dev);
+		chan->comb_dev = NULL;
+		goto out_comb;
+	}
+
 	return 0;
 
+out_comb:
+	device_destroy(&zio_cdev_class, chan->data_dev->devt);
 out_data:
 	device_destroy(&zio_cdev_class, chan->ctrl_dev->devt);
 out:
@@ -235,14 +427,43 @@ out:
 void zio_destroy_chan_devices(struct zio_channel *chan)
 {
 	pr_debug("%s\n", __func__);
+	kfree(chan->stream_ctrl);
+	chan->stream_ctrl = NULL;
 	if ((chan->cset->flags & ZIO_CSET_INTERLEAVE_ONLY) &&
 	    !(chan->flags & ZIO_CSET_CHAN_INTERLEAVE))
 		return;
 
+	if (chan->comb_dev)
+		device_destroy(&zio_cdev_class, chan->comb_dev->devt);
 	device_destroy(&zio_cdev_class, chan->data_dev->devt);
 	device_destroy(&zio_cdev_class, chan->ctrl_dev->devt);
 }
 
+/* create the gather char device of an input cset, after the combined ones */
+int zio_create_cset_device(struct zio_cset *cset)
+{
+	struct device *dev;
+
+	if ((cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return 0;
+	dev = device_create(&zio_cdev_class, &cset->head.dev,
+			    zstat->xbasedev + cset->xminor + cset->n_chan,
+			    &cset->flags,
+			    "%s-%i-all", dev_name(&cset->zdev->head.dev),
+			    cset->index);
+	if (IS_ERR(dev))
+		return PTR_ERR(dev);
+	cset->gather_dev = dev;
+	return 0;
+}
+
+void zio_destroy_cset_device(struct zio_cset *cset)
+{
+	if (cset->gather_dev)
+		device_destroy(&zio_cdev_class, cset->gather_dev->devt);
+	cset->gather_dev = NULL;
+}
+
 int zio_register_cdev()
 {
 	int err;
@@ -266,33 +487,302 @@ int zio_register_cdev()
 	err = cdev_add(&zstat->chrdev, zstat->basedev, ZIO_NR_MINORS);
 	if (err)
 		goto out_cdev;
+
+	/* combined and gather devices don't move the ctrl/data minors */
+	zstat->xminors = zio_ffa_create(0, ZIO_NR_MINORS);
+	err = alloc_chrdev_region(&zstat->xbasedev, 0, ZIO_NR_MINORS,
+				  "zio-extra");
+	if (err) {
+		pr_err("%s: unable to allocate extra region for %i minors\n",
+		       __func__, ZIO_NR_MINORS);
+		goto out_xregion;
+	}
+	cdev_init(&zstat->xchrdev, &zxfops);
+	zstat->xchrdev.owner = THIS_MODULE;
+	err = cdev_add(&zstat->xchrdev, zstat->xbasedev, ZIO_NR_MINORS);
+	if (err)
+		goto out_xcdev;
 	INIT_LIST_HEAD(&zstat->list_cset);
 	return 0;
+out_xcdev:
+	unregister_chrdev_region(zstat->xbasedev, ZIO_NR_MINORS);
+out_xregion:
+	cdev_del(&zstat->chrdev);
 out_cdev:
 	unregister_chrdev_region(zstat->basedev, ZIO_NR_MINORS);
 out:
 	class_unregister(&zio_cdev_class);
+	zio_ffa_destroy(zstat->xminors);
 	zio_ffa_destroy(zstat->minors);
 
 	return err;
 }
 void zio_unregister_cdev()
 {
+	cdev_del(&zstat->xchrdev);
+	unregister_chrdev_region(zstat->xbasedev, ZIO_NR_MINORS);
 	cdev_del(&zstat->chrdev);
 	unregister_chrdev_region(zstat->basedev, ZIO_NR_MINORS);
 	class_unregister(&zio_cdev_class);
+	zio_ffa_destroy(zstat->xminors);
 	zio_ffa_destroy(zstat->minors);
 }
 
 
+/*
+ * User memory for read and write: a plain pointer, or an iov_iter that
+ * may scatter the control and the data to different places. The offset
+ * is only used by the former, as the iterator advances by itself.
+ */
+struct zio_uio {
+	char __user		*ubuf;
+#if ZIO_HAS_ITER
+	struct iov_iter		*iter;
+#endif
+	int			nonblock;
+};
+
+static int zio_uio_to(struct zio_uio *uio, size_t off, const void *src,
+		      size_t n)
+{
+#if ZIO_HAS_ITER
+	if (uio->iter)
+		return copy_to_iter(src, n, uio->iter) == n ? 0 : -EFAULT;
+#endif
+	return copy_to_user(uio->ubuf + off, src, n) ? -EFAULT : 0;
+}
+
+static int zio_uio_from(struct zio_uio *uio, size_t off, void *dst,
+			size_t n)
+{
+#if ZIO_HAS_ITER
+	if (uio->iter)
+		return copy_from_iter(dst, n, uio->iter) == n ? 0 : -EFAULT;
+#endif
+	return copy_from_user(dst, uio->ubuf + off, n) ? -EFAULT : 0;
+}
+
+/*
+ * Return a control in the format of the channel: whole, or the head
+ * followed by the selected attributes and the terminator. The format is
+ * only read here, so it can't change in the middle of a control. It
+ * returns the size, or -EINVAL if there is not enough room.
+ */
+static ssize_t zio_uio_to_ctrl(struct zio_uio *uio, size_t off, size_t room,
+			       struct zio_channel *chan,
+			       struct zio_control *ctrl)
+{
+	static const struct zio_tlv end;
+	unsigned int fmt = READ_ONCE(chan->ctrl_fmt);
+	size_t size = __zio_control_size(fmt), done;
+	uint32_t head[__ZIO_CONTROL_HEAD_SIZE / 4], tlv[2];
+
+	if (room < size)
+		return -EINVAL;
+	if (!fmt)
+		return zio_uio_to(uio, off, ctrl, size) ? -EFAULT : size;
+
+	memcpy(head, ctrl, sizeof(head));
+	head[offsetof(struct zio_control, flags) / 4] |= ZIO_CONTROL_COMPACT;
+	if (zio_uio_to(uio, off, head, sizeof(head)))
+		return -EFAULT;
+	done = sizeof(head);
+	tlv[1] = sizeof(struct zio_tlv_attr) / sizeof(struct zio_tlv);
+	if (fmt & ZIO_CTRL_FMT_ATTR_CHAN) {
+		tlv[0] = ZIO_TLV_ATTR_CHAN;
+		if (zio_uio_to(uio, off + done, tlv, sizeof(tlv)) ||
+		    zio_uio_to(uio, off + done + sizeof(tlv),
+			       &ctrl->attr_channel, sizeof(ctrl->attr_channel)))
+			return -EFAULT;
+		done += sizeof(struct zio_tlv_attr);
+	}
+	if (fmt & ZIO_CTRL_FMT_ATTR_TRIG) {
+		tlv[0] = ZIO_TLV_ATTR_TRIG;
+		if (zio_uio_to(uio, off + done, tlv, sizeof(tlv)) ||
+		    zio_uio_to(uio, off + done + sizeof(tlv),
+			       &ctrl->attr_trigger, sizeof(ctrl->attr_trigger)))
+			return -EFAULT;
+		done += sizeof(struct zio_tlv_attr);
+	}
+	if (zio_uio_to(uio, off + done, &end, sizeof(end)))
+		return -EFAULT;
+	return size;
+}
+
+/*
+ * Stream read: a data read may consume several blocks, and their controls
+ * are kept here (the last ZIO_STREAM_CTRLS of them) for the ctrl cdev.
+ * head and tail are free-running and protected by user_lock.
+ */
+#define ZIO_STREAM_CTRLS 64
+
+int zio_chan_stream_set(struct zio_channel *chan, int on)
+{
+	struct zio_control *ctrls = NULL;
+	unsigned long flags;
+
+	if (on) {
+		ctrls = kmalloc_array(ZIO_STREAM_CTRLS, __ZIO_CONTROL_SIZE,
+				      GFP_KERNEL);
+		if (!ctrls)
+			return -ENOMEM;
+	}
+	mutex_lock(&chan->user_lock);
+	if (on && chan->stream_ctrl) { /* already there: keep the backlog */
+		mutex_unlock(&chan->user_lock);
+		kfree(ctrls);
+		return 0;
+	}
+	swap(chan->stream_ctrl, ctrls);
+	chan->stream_head = chan->stream_tail = 0;
+	spin_lock_irqsave(&chan->cset->lock, flags);
+	if (on)
+		chan->flags |= ZIO_CHAN_STREAM_READ;
+	else
+		chan->flags &= ~ZIO_CHAN_STREAM_READ;
+	spin_unlock_irqrestore(&chan->cset->lock, flags);
+	mutex_unlock(&chan->user_lock);
+	kfree(ctrls);
+	return 0;
+}
+
+static inline int zio_stream_full(struct zio_channel *chan)
+{
+	return chan->stream_head - chan->stream_tail == ZIO_STREAM_CTRLS;
+}
+
+/* Save the control of a block consumed by a data read, if not read yet */
+static void zio_stream_save(struct zio_channel *chan, struct zio_block *block)
+{
+	unsigned int size = __ZIO_CONTROL_SIZE;
+	unsigned int head = chan->stream_head;
+	struct zio_control *ctrl;
+	int lost = 0;
+
+	if (zio_is_cdone(block))
+		return;
+	/*
+	 * Reads stop at a full backlog, but a reader that never reads
+	 * controls fills it anyway: then the oldest control is lost, and
+	 * the one after it says so.
+	 */
+	if (zio_stream_full(chan)) {
+		chan->stream_tail++;
+		lost = 1;
+	}
+	ctrl = (void *)chan->stream_ctrl + (head % ZIO_STREAM_CTRLS) * size;
+	memcpy(ctrl, zio_get_ctrl(block), size);
+	if (lost) {
+		ctrl = (void *)chan->stream_ctrl +
+			(chan->stream_tail % ZIO_STREAM_CTRLS) * size;
+		ctrl->zio_alarms |= ZIO_ALARM_LOST_BLOCK;
+	}
+	WRITE_ONCE(chan->stream_head, head + 1);
+}
+
+/* Return as many saved controls as they fit, with user_lock held */
+static ssize_t zio_stream_read_ctrl(struct zio_channel *chan,
+				    struct zio_uio *uio, size_t count)
+{
+	unsigned int tail = chan->stream_tail;
+	struct zio_control *ctrl;
+	size_t done = 0;
+	ssize_t ret;
+
+	for (; tail != chan->stream_head; tail++) {
+		ctrl = (void *)chan->stream_ctrl +
+			(tail % ZIO_STREAM_CTRLS) * __ZIO_CONTROL_SIZE;
+		ret = zio_uio_to_ctrl(uio, done, count - done, chan, ctrl);
+		if (ret < 0)
+			return done || ret == -EINVAL ? done : ret;
+		done += ret;
+		chan->stream_tail = tail + 1;
+	}
+	return done;
+}
+
+#if ZIO_HAS_SPLICE
+/*
+ * A block whose pages are in a pipe. It goes back to the buffer when the
+ * user is done with it (one reference) and the pipe released all pages
+ * (one reference each). It pins the channel and its buffer instance.
+ */
+struct zio_splice_block {
+	struct zio_channel	*chan;
+	struct zio_block	*block;
+	atomic_t		refs;
+};
+
+static void zio_splice_put(struct zio_splice_block *sblock)
+{
+	struct zio_channel *chan = sblock->chan;
+
+	if (!atomic_dec_and_test(&sblock->refs))
+		return;
+	zio_buffer_free_block(chan->bi, sblock->block);
+	atomic_dec(&chan->n_spliced);
+	zio_channel_put(chan);
+	kfree(sblock);
+}
+#endif
+
+/* The user block is over: free it, unless its pages are still in a pipe */
+static void zio_user_block_done(struct zio_channel *chan)
+{
+	struct zio_block *block = chan->user_block;
+
+	chan->user_block = NULL;
+#if ZIO_HAS_SPLICE
+	if (chan->user_sblock) {
+		zio_splice_put(chan->user_sblock);
+		chan->user_sblock = NULL;
+		return;
+	}
+#endif
+	zio_buffer_free_block(chan->bi, block);
+}
+
 /*
  * Helper functions to check whether read and write would block. The
  * return value is a poll(2) mask, so the poll method just calls them.
  * We need locking, so to avoid hairy ifs we split read/write and ctrl/data
  * Both functions return with a user block if read/write can happen.
+ * With "nowait" they don't sleep on user_lock (nor allocating), and a
+ * busy lock is reported as "not ready": the caller returns -EAGAIN.
  */
 
-static int zio_can_r_ctrl(struct zio_f_priv *priv)
+/* Take user_lock, unless it is busy and we must not sleep */
+static int zio_user_lock(struct zio_channel *chan, int nowait)
+{
+	if (!nowait) {
+		mutex_lock(&chan->user_lock);
+		return 0;
+	}
+	return mutex_trylock(&chan->user_lock) ? 0 : -EAGAIN;
+}
+
+/* Both ctrl and data, for shared-read consumers */
+static int zio_can_r_shared(struct zio_f_priv *priv, int nowait)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_shared_block *sb;
+	const int ret_ok =  POLLIN | POLLRDNORM;
+	int ret = ret_ok;
+
+	if (zio_user_lock(chan, nowait))
+		return 0;
+	sb = zio_shared_get(priv);
+	if (!sb) {
+		ret = 0;
+		if (priv->type == ZIO_CDEV_CTRL &&
+		    unlikely(chan->cset->ti->flags & ZIO_DISABLED))
+			ret = POLLERR;
+	}
+	mutex_unlock(&chan->user_lock);
+	return ret;
+}
+
+static int zio_can_r_ctrl(struct zio_f_priv *priv, int nowait)
 {
 	struct zio_channel *chan = priv->chan;
 	struct zio_bi *bi = chan->bi;
@@ -302,14 +792,17 @@ static int zio_can_r_ctrl(struct zio_f_priv *priv)
 	dev_dbg(&bi->head.dev, "%s: channel %d in cset %d", __func__,
 		bi->chan->index, bi->chan->cset->index);
 
+	if (priv->cons)
+		return zio_can_r_shared(priv, nowait);
+
 	/* If we want to read control, we discard any trailing data */
-	mutex_lock(&chan->user_lock);
+	if (zio_user_lock(chan, nowait))
+		return 0;
 
 	/* Control: if not yet done, we can read */
 	if (chan->user_block) {
 		if (zio_is_cdone(chan->user_block)) {
-			zio_buffer_free_block(bi, chan->user_block);
-			chan->user_block = NULL;
+			zio_user_block_done(chan);
 		} else{
 			mutex_unlock(&chan->user_lock);
 			return ret_ok;
@@ -328,17 +821,20 @@ static int zio_can_r_ctrl(struct zio_f_priv *priv)
 	return ret;
 }
 
-static int zio_can_r_data(struct zio_f_priv *priv)
+static int zio_can_r_data(struct zio_f_priv *priv, int nowait)
 {
 	struct zio_channel *chan = priv->chan;
 	struct zio_block *block;
 	struct zio_bi *bi = chan->bi;
 	const int ret_ok =  POLLIN | POLLRDNORM;
 
-	if (!chan->cset->ssize)
+	if (!chan->cset->ssize && priv->type == ZIO_CDEV_DATA)
 		return 0;
+	if (priv->cons)
+		return zio_can_r_shared(priv, nowait);
 
-	mutex_lock(&chan->user_lock);
+	if (zio_user_lock(chan, nowait))
+		return 0;
 	block = chan->user_block;
 	if (block) {
 		mutex_unlock(&chan->user_lock);
@@ -351,16 +847,18 @@ static int zio_can_r_data(struct zio_f_priv *priv)
 	return 0;
 }
 
-static struct zio_block *__zio_write_allocblock(struct zio_bi *bi)
+static struct zio_block *__zio_write_allocblock(struct zio_bi *bi,
+						int nowait)
 {
 	struct zio_cset *cset = bi->chan->cset;
 	size_t datalen;
 
 	datalen = cset->ssize * cset->ti->nsamples;
-	return zio_buffer_alloc_block(bi, datalen, GFP_KERNEL);
+	return zio_buffer_alloc_block(bi, datalen,
+				      nowait ? GFP_NOWAIT : GFP_KERNEL);
 }
 
-static int zio_can_w_ctrl(struct zio_f_priv *priv)
+static int zio_can_w_ctrl(struct zio_f_priv *priv, int nowait)
 {
 	struct zio_channel *chan = priv->chan;
 	struct zio_bi *bi = chan->bi;
@@ -376,7 +874,8 @@ static int zio_can_w_ctrl(struct zio_f_priv *priv)
 	 * FIXME: shall we pick the nsamples from this control?
 	 * We currently obey trigger configuration and ignore the control.
 	 */
-	mutex_lock(&chan->user_lock);
+	if (zio_user_lock(chan, nowait))
+		return 0;
 	block = chan->user_block;
 	if (block && block->uoff) {
 		/* store a partial block */
@@ -390,7 +889,7 @@ static int zio_can_w_ctrl(struct zio_f_priv *priv)
 	}
 	/* if no block is there, get a new one */
 	if (!block)
-		block = chan->user_block = __zio_write_allocblock(bi);
+		block = chan->user_block = __zio_write_allocblock(bi, nowait);
 	ret = 0;
 	if (block)
 		ret = ret_ok;
@@ -400,7 +899,7 @@ static int zio_can_w_ctrl(struct zio_f_priv *priv)
 	return ret;
 }
 
-static int zio_can_w_data(struct zio_f_priv *priv)
+static int zio_can_w_data(struct zio_f_priv *priv, int nowait)
 {
 	struct zio_channel *chan = priv->chan;
 	struct zio_bi *bi = chan->bi;
@@ -410,55 +909,199 @@ static int zio_can_w_data(struct zio_f_priv *priv)
 	if (!chan->cset->ssize)
 		return 0;
 
-	mutex_lock(&chan->user_lock);
+	if (zio_user_lock(chan, nowait))
+		return 0;
 	block = chan->user_block;
 	if (!block)
-		block = chan->user_block = __zio_write_allocblock(bi);
+		block = chan->user_block = __zio_write_allocblock(bi, nowait);
 	mutex_unlock(&chan->user_lock);
 	return block ? ret_ok : 0;
 }
 
+/*
+ * Copy from the consumer's block, with user_lock held. It returns -EAGAIN
+ * if there is nothing to read at the cursor (any more). Like the single
+ * cursor case, the combined cdev continues with the next ready blocks.
+ */
+static ssize_t zio_shared_read(struct zio_f_priv *priv, struct zio_uio *uio,
+			       size_t count)
+{
+	struct zio_consumer *cons = priv->cons;
+	struct zio_shared_block *sb;
+	struct zio_block *block;
+	size_t done, n;
+	ssize_t ret, err = 0;
+
+	sb = zio_shared_get(priv);
+	if (!sb)
+		return -EAGAIN;
+	block = sb->block;
+
+	/* A ctrl file is done with the block once it read the control */
+	if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
+		ret = zio_uio_to_ctrl(uio, 0, count, priv->chan,
+				      zio_get_ctrl(block));
+		if (ret > 0)
+			zio_shared_consume(priv->chan, cons, sb);
+		return ret;
+	}
+
+	/* data, preceded by the control on the combined cdev */
+	for (done = 0; ; block = sb->block) {
+		if (priv->type == ZIO_CDEV_COMBINED && !cons->cdone) {
+			ret = zio_uio_to_ctrl(uio, done, count - done,
+					      priv->chan, zio_get_ctrl(block));
+			if (ret < 0) {
+				/* No room is only an error for the first one */
+				if (!done || ret != -EINVAL)
+					err = ret;
+				break;
+			}
+			cons->cdone = 1;
+			done += ret;
+		}
+		n = min_t(size_t, count - done, block->datalen - cons->uoff);
+		if (zio_uio_to(uio, done, block->data + cons->uoff, n)) {
+			err = -EFAULT;
+			break;
+		}
+		cons->uoff += n;
+		done += n;
+		if (cons->uoff < block->datalen)
+			break;
+		zio_shared_consume(priv->chan, cons, sb);
+		if (priv->type != ZIO_CDEV_COMBINED || done == count)
+			break;
+		sb = zio_shared_get(priv);
+		if (!sb)
+			break;
+	}
+	return done ? done : err;
+}
+
+/*
+ * mmap-output: reading the control of an output channel reserves the next
+ * block; user space fills its data in the map, at mem_offset, and writes
+ * the control back (with the actual nsamples) to commit it.
+ */
+static ssize_t zio_mmap_reserve(struct zio_f_priv *priv, struct zio_uio *uio,
+				size_t count)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_bi *bi = chan->bi;
+	unsigned int size = zio_control_size(chan);
+	struct zio_control *ctrl;
+	int err;
+
+	if (count < size)
+		return -EINVAL;
+	while (1) {
+		if (!zio_can_w_data(priv, uio->nonblock)) {
+			if (uio->nonblock)
+				return -EAGAIN;
+			wait_event_interruptible(bi->q, zio_can_w_data(priv, 0));
+			if (signal_pending(current))
+				return -ERESTARTSYS;
+		}
+		if (zio_user_lock(chan, uio->nonblock))
+			return -EAGAIN;
+		if (chan->user_block)
+			break;
+		mutex_unlock(&chan->user_lock);
+	}
+	ctrl = zio_get_ctrl(chan->user_block);
+	ctrl->nsamples = chan->user_block->datalen / chan->cset->ssize;
+	err = zio_uio_to(uio, 0, ctrl, size);
+	mutex_unlock(&chan->user_lock);
+	return err ? err : size;
+}
+
+static int zio_mmap_commit(struct zio_channel *chan, struct zio_block *block,
+			   uint32_t mem_offset)
+{
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	size_t datalen = (size_t)ctrl->nsamples * chan->cset->ssize;
+
+	/* The block must be the reserved one, and not grow */
+	if (ctrl->mem_offset != mem_offset || !datalen ||
+	    datalen > block->datalen) {
+		ctrl->mem_offset = mem_offset;
+		return -EINVAL;
+	}
+	block->datalen = datalen;
+	zio_buffer_store_block(chan->bi, block);
+	chan->user_block = NULL;
+	return 0;
+}
+
 /*
  * The following "generic" read and write (and poll and so on) should
  * work for most buffer types, and are exported for use in their
  * buffer operations.
  */
-static ssize_t zio_generic_read(struct file *f, char __user *ubuf,
-			 size_t count, loff_t *offp)
+static ssize_t __zio_read(struct zio_f_priv *priv, struct zio_uio *uio,
+			  size_t count)
 {
-	struct zio_f_priv *priv = f->private_data;
 	struct zio_channel *chan = priv->chan;
 	struct zio_bi *bi = chan->bi;
 	struct zio_block *block;
-	int (*can_read)(struct zio_f_priv *);
-	int fault, rflags;
+	int (*can_read)(struct zio_f_priv *, int);
+	int rflags, stream, combined;
+	size_t done, n;
+	ssize_t ret, err;
 
 	dev_dbg(&bi->head.dev, "%s:%d type %s\n", __func__, __LINE__,
-		priv->type == ZIO_CDEV_CTRL ? "ctrl" : "data");
+		priv->type == ZIO_CDEV_CTRL ? "ctrl" :
+		priv->type == ZIO_CDEV_DATA ? "data" : "combined");
 
-	if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+	if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT) {
+		if (priv->type == ZIO_CDEV_CTRL &&
+		    (bi->flags & ZIO_BI_MMAP_OUTPUT))
+			return zio_mmap_reserve(priv, uio, count);
 		return -EINVAL;
+	}
+
+	/* Stream read is a single-cursor thing: not for shared readers */
+	stream = (chan->flags & ZIO_CHAN_STREAM_READ) && !priv->cons;
+	/* The combined cdev always goes on with the next ready blocks */
+	combined = priv->type == ZIO_CDEV_COMBINED;
 
 	can_read = zio_can_r_data;
 	if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
 		if (count < zio_control_size(chan))
 			return -EINVAL;
-		count = zio_control_size(chan);
+		if (stream) {
+			/* Controls of blocks already read as data come first */
+			if (zio_user_lock(chan, uio->nonblock))
+				return -EAGAIN;
+			ret = zio_stream_read_ctrl(chan, uio, count);
+			mutex_unlock(&chan->user_lock);
+			if (ret)
+				return ret;
+		}
 		can_read = zio_can_r_ctrl;
 	}
 
 	while (1) {
-		rflags = can_read(priv);
+		rflags = can_read(priv, uio->nonblock);
 		if (rflags == 0 || rflags == POLLERR) {
-			if (f->f_flags & O_NONBLOCK)
+			if (uio->nonblock)
 				return -EAGAIN;
-			wait_event_interruptible(bi->q, can_read(priv));
+			wait_event_interruptible(bi->q, can_read(priv, 0));
 			if (signal_pending(current))
 				return -ERESTARTSYS;
 		}
 
 		/* So, it has been readable, at least for a little while */
-		mutex_lock(&chan->user_lock);
+		if (zio_user_lock(chan, uio->nonblock))
+			return -EAGAIN;
+		if (priv->cons) {
+			ret = zio_shared_read(priv, uio, count);
+			mutex_unlock(&chan->user_lock);
+			if (ret == -EAGAIN)
+				continue;
+			return ret;
+		}
 		block = chan->user_block;
 		if (!block) {
 			mutex_unlock(&chan->user_lock);
@@ -470,48 +1113,75 @@ static ssize_t zio_generic_read(struct file *f, char __user *ubuf,
 				mutex_unlock(&chan->user_lock);
 				continue;
 			}
-			fault = copy_to_user(ubuf, zio_get_ctrl(block), count);
+			ret = zio_uio_to_ctrl(uio, 0, count, chan,
+					      zio_get_ctrl(block));
+			if (ret > 0)
+				zio_set_cdone(block);
 			mutex_unlock(&chan->user_lock);
-			if (fault)
-				return -EFAULT;
-			zio_set_cdone(block);
-			*offp += count;
-			return count;
+			return ret;
 		}
 
-		/* data */
-		if (count > block->datalen - block->uoff)
-			count = block->datalen - block->uoff;
-		fault = copy_to_user(ubuf, block->data + block->uoff, count);
-		if (!fault) {
-			block->uoff += count;
-			if (block->uoff == block->datalen) {
-				chan->user_block = NULL;
-				zio_buffer_free_block(bi, block);
+		/*
+		 * Data, preceded by the control on the combined cdev. In
+		 * stream mode, go on with the next ready blocks.
+		 */
+		for (done = 0, err = 0; ; ) {
+			if (combined && !zio_is_cdone(block)) {
+				/* The control is only returned whole */
+				ret = zio_uio_to_ctrl(uio, done, count - done,
+						      chan,
+						      zio_get_ctrl(block));
+				if (ret < 0) {
+					if (!done || ret != -EINVAL)
+						err = ret;
+					break;
+				}
+				zio_set_cdone(block);
+				done += ret;
+			}
+			n = min_t(size_t, count - done,
+				  block->datalen - block->uoff);
+			if (zio_uio_to(uio, done,
+				       block->data + block->uoff, n)) {
+				err = -EFAULT;
+				break;
 			}
+			block->uoff += n;
+			done += n;
+			if (block->uoff < block->datalen)
+				break;
+			if (stream)
+				zio_stream_save(chan, block);
+			zio_user_block_done(chan);
+			if (!(stream || combined) || done == count)
+				break;
+			/* Don't consume blocks whose controls can't be kept */
+			if (stream && zio_stream_full(chan))
+				break;
+			block = chan->user_block = zio_buffer_retr_block(bi);
+			if (!block)
+				break;
 		}
 		mutex_unlock(&chan->user_lock);
-		if (fault)
-			return -EFAULT;
-		*offp += count;
-		return count;
+		return done ? done : err;
 	}
 }
 
-static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
-			  size_t count, loff_t *offp)
+static ssize_t __zio_write(struct zio_f_priv *priv, struct zio_uio *uio,
+			   size_t count)
 {
-	struct zio_f_priv *priv = f->private_data;
 	struct zio_channel *chan = priv->chan;
 	struct zio_bi *bi = chan->bi;
 	struct zio_block *block;
-	int (*can_write)(struct zio_f_priv *);
+	int (*can_write)(struct zio_f_priv *, int);
 	int fault, wflags;
+	uint32_t mem_offset;
 
 	dev_dbg(&bi->head.dev, "%s:%d type %s\n", __func__, __LINE__,
 		priv->type == ZIO_CDEV_CTRL ? "ctrl" : "data");
 
-	if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT)
+	if ((bi->flags & ZIO_DIR) == ZIO_DIR_INPUT ||
+	    priv->type == ZIO_CDEV_COMBINED)
 		return -EINVAL;
 
 	can_write = zio_can_w_data;
@@ -522,17 +1192,18 @@ static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
 	}
 
 	while (1) {
-		wflags = can_write(priv);
+		wflags = can_write(priv, uio->nonblock);
 		if (wflags == 0 || wflags == POLLERR) {
-			if (f->f_flags & O_NONBLOCK)
+			if (uio->nonblock)
 				return -EAGAIN;
-			wait_event_interruptible(bi->q, can_write(priv));
+			wait_event_interruptible(bi->q, can_write(priv, 0));
 			if (signal_pending(current))
 				return -ERESTARTSYS;
 		}
 
 		/* So, it has been writeable, at least for a little while */
-		mutex_lock(&chan->user_lock);
+		if (zio_user_lock(chan, uio->nonblock))
+			return -EAGAIN;
 		block = chan->user_block;
 		if (!block) {
 			mutex_unlock(&chan->user_lock);
@@ -546,24 +1217,23 @@ static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
 			 * we are currently discarding it
 			 */
 			block->uoff = 0;
-			fault = copy_from_user(zio_get_ctrl(block), ubuf,
-					       count);
+			mem_offset = zio_get_ctrl(block)->mem_offset;
+			fault = zio_uio_from(uio, 0, zio_get_ctrl(block), count);
 			/* FIXME: preserve some fields in the output ctrl */
-			if (!fault && !chan->cset->ssize) {
+			if (!fault && (bi->flags & ZIO_BI_MMAP_OUTPUT)) {
+				fault = zio_mmap_commit(chan, block, mem_offset);
+			} else if (!fault && !chan->cset->ssize) {
 				zio_buffer_store_block(bi, block); /* 0-size */
 				chan->user_block = NULL;
 			}
 			mutex_unlock(&chan->user_lock);
-			if (fault)
-				return -EFAULT;
-			*offp += count;
-			return count;
+			return fault ? fault : count;
 		}
 
 		/* data */
 		if (count > block->datalen - block->uoff)
 			count =  block->datalen - block->uoff;
-		fault = copy_from_user(block->data + block->uoff, ubuf, count);
+		fault = zio_uio_from(uio, 0, block->data + block->uoff, count);
 		if (!fault) {
 			block->uoff += count;
 			if (block->uoff == block->datalen) {
@@ -572,13 +1242,229 @@ static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
 			}
 		}
 		mutex_unlock(&chan->user_lock);
-		if (fault)
-			return -EFAULT;
-		*offp += count;
-		return count;
+		return fault ? fault : count;
 	}
 }
 
+static ssize_t zio_generic_read(struct file *f, char __user *ubuf,
+				size_t count, loff_t *offp)
+{
+	struct zio_uio uio = {
+		.ubuf = ubuf,
+		.nonblock = f->f_flags & O_NONBLOCK,
+	};
+	ssize_t ret = __zio_read(f->private_data, &uio, count);
+
+	if (ret > 0)
+		*offp += ret;
+	return ret;
+}
+
+static ssize_t zio_generic_write(struct file *f, const char __user *ubuf,
+				 size_t count, loff_t *offp)
+{
+	struct zio_uio uio = {
+		.ubuf = (char __user *)ubuf,
+		.nonblock = f->f_flags & O_NONBLOCK,
+	};
+	ssize_t ret = __zio_write(f->private_data, &uio, count);
+
+	if (ret > 0)
+		*offp += ret;
+	return ret;
+}
+
+#if ZIO_HAS_ITER
+/*
+ * Vectored and asynchronous (io_uring) I/O. With IOCB_NOWAIT we never
+ * wait for a block nor for user_lock, like O_NONBLOCK does.
+ */
+static int zio_iocb_nonblock(struct kiocb *iocb)
+{
+	if (iocb->ki_filp->f_flags & O_NONBLOCK)
+		return 1;
+#ifdef IOCB_NOWAIT
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return 1;
+#endif
+	return 0;
+}
+
+static ssize_t zio_generic_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct zio_uio uio = {
+		.iter = to,
+		.nonblock = zio_iocb_nonblock(iocb),
+	};
+	ssize_t ret = __zio_read(iocb->ki_filp->private_data, &uio,
+				 iov_iter_count(to));
+
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	return ret;
+}
+
+static ssize_t zio_generic_write_iter(struct kiocb *iocb,
+				      struct iov_iter *from)
+{
+	struct zio_uio uio = {
+		.iter = from,
+		.nonblock = zio_iocb_nonblock(iocb),
+	};
+	ssize_t ret = __zio_write(iocb->ki_filp->private_data, &uio,
+				  iov_iter_count(from));
+
+	if (ret > 0)
+		iocb->ki_pos += ret;
+	return ret;
+}
+#endif
+
+#if ZIO_HAS_SPLICE
+static void zio_pipe_buf_release(struct pipe_inode_info *pipe,
+				 struct pipe_buffer *buf)
+{
+	put_page(buf->page);
+	zio_splice_put((struct zio_splice_block *)buf->private);
+}
+
+#if KERNEL_VERSION(5, 8, 0) > LINUX_VERSION_CODE
+static void zio_pipe_buf_get(struct pipe_inode_info *pipe,
+			     struct pipe_buffer *buf)
+{
+	get_page(buf->page);
+	atomic_inc(&((struct zio_splice_block *)buf->private)->refs);
+}
+
+static int zio_pipe_buf_steal(struct pipe_inode_info *pipe,
+			      struct pipe_buffer *buf)
+{
+	return 1; /* the page belongs to the buffer */
+}
+#else
+static bool zio_pipe_buf_get(struct pipe_inode_info *pipe,
+			     struct pipe_buffer *buf)
+{
+	if (!try_get_page(buf->page))
+		return false;
+	atomic_inc(&((struct zio_splice_block *)buf->private)->refs);
+	return true;
+}
+#endif
+
+static const struct pipe_buf_operations zio_pipe_buf_ops = {
+#if KERNEL_VERSION(5, 8, 0) > LINUX_VERSION_CODE
+	.confirm =	generic_pipe_buf_confirm,
+	.steal =	zio_pipe_buf_steal,
+#endif
+	.release =	zio_pipe_buf_release,
+	.get =		zio_pipe_buf_get,
+};
+
+/* Pages that splice_to_pipe could not place */
+static void zio_splice_spd_release(struct splice_pipe_desc *spd,
+				   unsigned int i)
+{
+	put_page(spd->pages[i]);
+	zio_splice_put((struct zio_splice_block *)spd->partial[i].private);
+}
+
+/*
+ * Splice data to a pipe without copying: the pipe gets the pages of the
+ * user block, and the block is only freed when all of them are released.
+ * It is only offered for buffers whose data is in pages (vmalloc).
+ */
+static ssize_t zio_generic_splice_read(struct file *f, loff_t *ppos,
+				       struct pipe_inode_info *pipe,
+				       size_t len, unsigned int flags)
+{
+	struct zio_f_priv *priv = f->private_data;
+	struct zio_channel *chan = priv->chan;
+	struct zio_bi *bi = chan->bi;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &zio_pipe_buf_ops,
+		.spd_release = zio_splice_spd_release,
+	};
+	struct zio_splice_block *sblock;
+	struct zio_block *block;
+	unsigned int plen;
+	ssize_t ret;
+	void *p;
+
+	/* Shared-read consumers and the combined cdev use read() */
+	if (priv->type != ZIO_CDEV_DATA || priv->cons ||
+	    (bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT || !chan->cset->ssize)
+		return -EINVAL;
+
+	while (1) {
+		if (!zio_can_r_data(priv, 0)) {
+			if ((f->f_flags & O_NONBLOCK) ||
+			    (flags & SPLICE_F_NONBLOCK))
+				return -EAGAIN;
+			wait_event_interruptible(bi->q, zio_can_r_data(priv, 0));
+			if (signal_pending(current))
+				return -ERESTARTSYS;
+		}
+		mutex_lock(&chan->user_lock);
+		if (chan->user_block)
+			break;
+		mutex_unlock(&chan->user_lock);
+	}
+	block = chan->user_block;
+
+	sblock = chan->user_sblock;
+	if (!sblock) {
+		sblock = kmalloc(sizeof(*sblock), GFP_KERNEL);
+		ret = sblock ? 0 : -ENOMEM;
+		if (sblock && !zio_channel_get(chan))
+			ret = -ENODEV;
+		if (ret) {
+			mutex_unlock(&chan->user_lock);
+			kfree(sblock);
+			return ret;
+		}
+		atomic_inc(&bi->use_count);
+		atomic_inc(&chan->n_spliced);
+		sblock->chan = chan;
+		sblock->block = block;
+		atomic_set(&sblock->refs, 1);
+		chan->user_sblock = sblock;
+	}
+
+	/* Each page in the pipe holds a reference to the block */
+	len = min_t(size_t, len, block->datalen - block->uoff);
+	p = block->data + block->uoff;
+	while (len && spd.nr_pages < spd.nr_pages_max) {
+		plen = min_t(size_t, len, PAGE_SIZE - offset_in_page(p));
+		pages[spd.nr_pages] = is_vmalloc_addr(p) ?
+			vmalloc_to_page(p) : virt_to_page(p);
+		partial[spd.nr_pages].offset = offset_in_page(p);
+		partial[spd.nr_pages].len = plen;
+		partial[spd.nr_pages].private = (unsigned long)sblock;
+		get_page(pages[spd.nr_pages]);
+		atomic_inc(&sblock->refs);
+		spd.nr_pages++;
+		p += plen;
+		len -= plen;
+	}
+
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0) {
+		block->uoff += ret;
+		if (block->uoff == block->datalen)
+			zio_user_block_done(chan);
+		*ppos += ret;
+	}
+	mutex_unlock(&chan->user_lock);
+	return ret;
+}
+#endif
+
 static int zio_generic_mmap(struct file *f, struct vm_area_struct *vma)
 {
 	struct zio_f_priv *priv = f->private_data;
@@ -602,40 +1488,103 @@ static int zio_generic_mmap(struct file *f, struct vm_area_struct *vma)
 			v_op->open(vma); /* returns void */
 	}
 	spin_unlock_irqrestore(&bi->lock, flags);
+	if (ret || !bi->b_op->mmap)
+		return ret;
+
+	/* Mapping may sleep, so it can't happen under the lock above */
+	ret = bi->b_op->mmap(bi, vma);
+	if (ret && v_op->close)
+		v_op->close(vma); /* the kernel won't call it on failure */
 	return ret;
 }
 
+/*
+ * Input readiness is checked without locking and without moving blocks:
+ * a block retrieved by read (the user block, or a shared block not yet
+ * read by this consumer) or stored in the buffer makes the cdev readable.
+ * Otherwise, we ask the trigger for data.
+ */
+static unsigned int zio_poll_input(struct zio_f_priv *priv)
+{
+	struct zio_channel *chan = priv->chan;
+	struct zio_bi *bi = chan->bi;
+	struct zio_ti *ti = bi->cset->ti;
+	struct zio_consumer *cons = priv->cons;
+	struct zio_block *block;
+	const int ret_ok =  POLLIN | POLLRDNORM;
+	uint32_t pending;
+
+	if (priv->type == ZIO_CDEV_DATA && !chan->cset->ssize)
+		return 0;
+
+	if (cons) {
+		/* Blocks between our cursor and the newest shared one */
+		pending = READ_ONCE(chan->shared_seq) - READ_ONCE(cons->seq);
+		if (pending)
+			return ret_ok;
+	} else {
+		block = READ_ONCE(chan->user_block);
+		if (block && (priv->type != ZIO_CDEV_CTRL ||
+			      !zio_is_cdone(block)))
+			return ret_ok;
+		if (priv->type == ZIO_CDEV_CTRL &&
+		    READ_ONCE(chan->stream_head) != READ_ONCE(chan->stream_tail))
+			return ret_ok;
+	}
+	if (zio_bi_nready(bi))
+		return ret_ok;
+
+	if (unlikely((ti->flags & ZIO_STATUS) == ZIO_DISABLED))
+		return priv->type != ZIO_CDEV_DATA ? POLLERR : 0;
+	/* There is no data in buffer, and we may pull to have data soon */
+	if (ti->t_op->pull_block && !(bi->flags & ZIO_DISABLED)) {
+		ti->t_op->pull_block(ti, chan);
+		if (zio_bi_nready(bi))
+			return ret_ok;
+	}
+	return 0;
+}
+
 static unsigned int zio_generic_poll(struct file *f,
 				     struct poll_table_struct *w)
 {
 	struct zio_f_priv *priv = f->private_data;
 	struct zio_bi *bi = priv->chan->bi;
+	unsigned int mask;
 
 	dev_dbg(&bi->head.dev, "%s: channel %d in cset %d", __func__,
 		bi->chan->index, bi->chan->cset->index);
 	poll_wait(f, &bi->q, w);
 
 	if ((bi->flags & ZIO_DIR) == ZIO_DIR_OUTPUT) {
-		if (unlikely(priv->type == ZIO_CDEV_CTRL))
-			return zio_can_w_ctrl(priv);
-		return zio_can_w_data(priv);
+		if (unlikely(priv->type == ZIO_CDEV_COMBINED))
+			return POLLERR;
+		if (unlikely(priv->type == ZIO_CDEV_CTRL)) {
+			mask = zio_can_w_ctrl(priv, 0);
+			/* mmap-output: the reserved block can be read */
+			if ((mask & POLLOUT) && (bi->flags & ZIO_BI_MMAP_OUTPUT))
+				mask |= POLLIN | POLLRDNORM;
+			return mask;
+		}
+		return zio_can_w_data(priv, 0);
 	}
-	if (unlikely(priv->type == ZIO_CDEV_CTRL))
-		return zio_can_r_ctrl(priv);
-	return zio_can_r_data(priv);
+	return zio_poll_input(priv);
 }
 
 static int zio_generic_release(struct inode *inode, struct file *f)
 {
 	struct zio_f_priv *priv = f->private_data;
 	struct zio_channel *chan = priv->chan;
-	struct zio_block *block = chan->user_block;
+	int users;
 
+	if (priv->cons)
+		zio_consumer_put(chan, priv->cons);
 	mutex_lock(&chan->user_lock);
-	if (atomic_read(&chan->bi->use_count) == 1 && chan->user_block) {
-		zio_buffer_free_block(chan->bi, block);
-		chan->user_block = NULL;
-	}
+	/* Blocks spliced to a pipe use the buffer, but they are not files */
+	users = atomic_read(&chan->bi->use_count) -
+		atomic_read(&chan->n_spliced);
+	if (users == 1 && chan->user_block)
+		zio_user_block_done(chan);
 	mutex_unlock(&chan->user_lock);
 	zio_channel_put(chan);
 	/* priv is allocated by zio_f_open, must be freed */
@@ -647,6 +1596,10 @@ const struct file_operations zio_generic_file_operations = {
 	/* no owner: this template is copied over */
 	.read =		zio_generic_read,
 	.write =	zio_generic_write,
+#if ZIO_HAS_ITER
+	.read_iter =	zio_generic_read_iter,
+	.write_iter =	zio_generic_write_iter,
+#endif
 	.poll =		zio_generic_poll,
 	.mmap =		zio_generic_mmap,
 	.release =	zio_generic_release,
@@ -672,6 +1625,10 @@ int zio_init_buffer_fops(struct zio_buffer_type *zbuf)
 	zbuf->flags |= ZIO_BUF_FLAG_ALLOC_FOPS;
 	*ops = zio_generic_file_operations;
 	ops->owner = zbuf->owner;
+#if ZIO_HAS_SPLICE
+	if (zbuf->flags & ZIO_BUF_FLAG_SPLICE)
+		ops->splice_read = zio_generic_splice_read;
+#endif
 	zbuf->f_op = ops;
 	return 0;
 }
@@ -685,3 +1642,269 @@ int zio_fini_buffer_fops(struct zio_buffer_type *zbuf)
 	zbuf->f_op = &zio_generic_file_operations;
 	return 0;
 }
+
+/*
+ * Gather read: the "-all" cdev of an input cset returns whole trigger
+ * events, a header followed by the control and data of each channel.
+ * Each block is retrieved into the slot of its channel and it stays
+ * there until the event it belongs to (by seq_num) is returned.
+ */
+struct zio_gather {
+	struct mutex		lock;
+	struct zio_cset		*cset;
+	struct zio_block	*block[];	/* one slot per channel */
+};
+
+static int zio_gather_enabled(struct zio_channel *chan)
+{
+	return !(chan->flags & ZIO_DISABLED) && chan->bi;
+}
+
+static void zio_gather_put(struct zio_gather *g)
+{
+	struct zio_cset *cset = g->cset;
+	int i;
+
+	for (i = 0; i < cset->n_chan; ++i) {
+		if (g->block[i])
+			zio_buffer_free_block(cset->chan[i].bi, g->block[i]);
+		atomic_dec(&cset->chan[i].bi->use_count);
+	}
+	module_put(cset->zdev->owner);
+	kfree(g);
+}
+
+/* Retrieve a block for empty slots; return how many are still empty */
+static int zio_gather_fill(struct zio_gather *g)
+{
+	struct zio_channel *chan;
+	int i, empty = 0;
+
+	for (i = 0; i < g->cset->n_chan; ++i) {
+		chan = g->cset->chan + i;
+		if (g->block[i] || !zio_gather_enabled(chan))
+			continue;
+		g->block[i] = zio_buffer_retr_block(chan->bi);
+		if (!g->block[i])
+			empty++;
+	}
+	return empty;
+}
+
+static unsigned int zio_gather_gen(struct zio_cset *cset)
+{
+	unsigned long flags;
+	unsigned int gen;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	gen = cset->done_gen;
+	spin_unlock_irqrestore(&cset->lock, flags);
+	return gen;
+}
+
+/* Find the oldest event in the slots and fill its header */
+static void zio_gather_event(struct zio_gather *g,
+			     struct zio_gather_header *head)
+{
+	struct zio_cset *cset = g->cset;
+	struct zio_control *ctrl;
+	unsigned int gen;
+	int i;
+
+	memset(head, 0, sizeof(*head));
+	/*
+	 * data_done stores the blocks of an event and counts it in
+	 * done_gen, all under the cset lock. If some slots are still
+	 * empty and an event was completed since we started (maybe while
+	 * we retrieved), fill again so we don't split its blocks.
+	 */
+	gen = zio_gather_gen(cset);
+	if (zio_gather_fill(g)) {
+		/* With deferred data_done, blocks are stored by the work */
+		if (cset->flags & ZIO_CSET_DEFER_DONE)
+			flush_work(&cset->done_work);
+		if (zio_gather_gen(cset) != gen)
+			zio_gather_fill(g);
+	}
+
+	for (i = 0; i < g->cset->n_chan; ++i) {
+		if (!g->block[i])
+			continue;
+		ctrl = zio_get_ctrl(g->block[i]);
+		if (!head->nchan || (int32_t)(ctrl->seq_num - head->seq_num) < 0)
+			head->seq_num = ctrl->seq_num;
+		head->nchan = 1;
+	}
+	if (!head->nchan)
+		return;
+
+	head->nchan = 0;
+	head->size = sizeof(*head);
+	for (i = 0; i < g->cset->n_chan; ++i) {
+		if (!g->block[i] ||
+		    zio_get_ctrl(g->block[i])->seq_num != head->seq_num)
+			continue;
+		head->nchan++;
+		head->size += __ZIO_CONTROL_SIZE +
+			ALIGN(g->block[i]->datalen, 8);
+	}
+}
+
+/* Copy the event described by head, and release its blocks */
+static int zio_gather_copy(struct zio_gather *g,
+			   struct zio_gather_header *head, char __user *ubuf)
+{
+	struct zio_block *block;
+	size_t off = sizeof(*head), len;
+	int i;
+
+	if (copy_to_user(ubuf, head, sizeof(*head)))
+		return -EFAULT;
+	for (i = 0; i < g->cset->n_chan; ++i) {
+		block = g->block[i];
+		if (!block || zio_get_ctrl(block)->seq_num != head->seq_num)
+			continue;
+		len = __ZIO_CONTROL_SIZE;
+		if (copy_to_user(ubuf + off, zio_get_ctrl(block), len))
+			return -EFAULT;
+		off += len;
+		if (copy_to_user(ubuf + off, block->data, block->datalen))
+			return -EFAULT;
+		off += block->datalen;
+		len = ALIGN(block->datalen, 8) - block->datalen;
+		if (len && clear_user(ubuf + off, len))
+			return -EFAULT;
+		off += len;
+	}
+
+	/* All copied: a fault above leaves the event for the next read */
+	for (i = 0; i < g->cset->n_chan; ++i) {
+		block = g->block[i];
+		if (!block || zio_get_ctrl(block)->seq_num != head->seq_num)
+			continue;
+		zio_buffer_free_block(g->cset->chan[i].bi, block);
+		g->block[i] = NULL;
+	}
+	return 0;
+}
+
+/* Something to read: a block in a slot or in an enabled channel */
+static int zio_gather_ready(struct zio_gather *g)
+{
+	struct zio_channel *chan;
+	int i;
+
+	for (i = 0; i < g->cset->n_chan; ++i) {
+		chan = g->cset->chan + i;
+		if (READ_ONCE(g->block[i]))
+			return 1;
+		if (zio_gather_enabled(chan) && zio_bi_nready(chan->bi))
+			return 1;
+	}
+	return 0;
+}
+
+static ssize_t zio_gather_read(struct file *f, char __user *ubuf,
+			       size_t count, loff_t *offp)
+{
+	struct zio_gather *g = f->private_data;
+	struct zio_gather_header head;
+	size_t done = 0;
+	int err = 0;
+
+	if (mutex_lock_interruptible(&g->lock))
+		return -ERESTARTSYS;
+	while (done < count) {
+		zio_gather_event(g, &head);
+		if (!head.nchan) {
+			if (done)
+				break;
+			if (f->f_flags & O_NONBLOCK) {
+				err = -EAGAIN;
+				break;
+			}
+			mutex_unlock(&g->lock);
+			if (wait_event_interruptible(g->cset->gather_q,
+						     zio_gather_ready(g)))
+				return -ERESTARTSYS;
+			if (mutex_lock_interruptible(&g->lock))
+				return -ERESTARTSYS;
+			continue;
+		}
+		/* Only whole events are returned */
+		if (done + head.size > count) {
+			if (!done)
+				err = -EINVAL;
+			break;
+		}
+		err = zio_gather_copy(g, &head, ubuf + done);
+		if (err)
+			break;
+		done += head.size;
+	}
+	mutex_unlock(&g->lock);
+	return done ? done : err;
+}
+
+static unsigned int zio_gather_poll(struct file *f,
+				    struct poll_table_struct *w)
+{
+	struct zio_gather *g = f->private_data;
+
+	poll_wait(f, &g->cset->gather_q, w);
+	if (zio_gather_ready(g))
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static int zio_gather_release(struct inode *inode, struct file *f)
+{
+	zio_gather_put(f->private_data);
+	return 0;
+}
+
+static const struct file_operations zio_gather_fops = {
+	.owner =	THIS_MODULE,
+	.read =		zio_gather_read,
+	.poll =		zio_gather_poll,
+	.release =	zio_gather_release,
+};
+
+static int zio_gather_open(struct zio_cset *cset, struct file *f)
+{
+	struct zio_gather *g;
+	unsigned long flags;
+	int i, err = 0;
+
+	if ((cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT ||
+	    !try_module_get(cset->zdev->owner))
+		return -ENODEV;
+	g = kzalloc(sizeof(*g) + cset->n_chan * sizeof(g->block[0]),
+		    GFP_KERNEL);
+	if (!g) {
+		module_put(cset->zdev->owner);
+		return -ENOMEM;
+	}
+	mutex_init(&g->lock);
+	g->cset = cset;
+
+	/* Like channel files, keep the buffer instances in use */
+	spin_lock_irqsave(&cset->lock, flags);
+	for (i = 0; i < cset->n_chan; ++i) {
+		atomic_inc(&cset->chan[i].bi->use_count);
+		if ((cset->chan[i].bi->flags & ZIO_STATUS) == ZIO_DISABLED)
+			err = -EAGAIN;
+	}
+	spin_unlock_irqrestore(&cset->lock, flags);
+	if (err) {
+		zio_gather_put(g);
+		return err;
+	}
+
+	mutex_lock(&zmutex);
+	fops_put(f->f_op);
+	f->f_op = fops_get(&zio_gather_fops);
+	mutex_unlock(&zmutex);
+	f->private_data = g;
+	return 0;
+}
@@ -11,6 +11,8 @@
 #include <linux/init.h>
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
 #include <linux/string.h>
 #include <linux/zio.h>
 #include <linux/zio-buffer.h>
@@ -22,26 +24,64 @@ const uint32_t zio_version = ZIO_VERSION(__ZIO_MAJOR_VERSION,
 struct zio_status zio_global_status;
 static struct zio_status *zstat = &zio_global_status; /* Always use ptr */
 /*
- * We use a local slab for control structures.
+ * We use a local slab for control structures. In front of it, each cpu
+ * keeps a small magazine of released controls, so the common
+ * alloc/free pairs of a block never reach the slab. Controls of other
+ * NUMA nodes go back to the slab, so magazines only hold local memory.
  */
 static struct kmem_cache *zio_ctrl_slab;
 
-struct zio_control *zio_alloc_control(gfp_t gfp)
+#define ZIO_CTRL_MAG_SIZE 16
+struct zio_ctrl_mag {
+	unsigned int n;
+	struct zio_control *ctrl[ZIO_CTRL_MAG_SIZE];
+	unsigned long hits, misses;
+};
+static DEFINE_PER_CPU(struct zio_ctrl_mag, zio_ctrl_mag);
+
+/* A clean control, with version and endianness: built once at load time */
+static struct zio_control zio_ctrl_template;
+
+/* Buffers that embed controls in their own memory initialize them here */
+void zio_init_control(struct zio_control *ctrl)
 {
-	struct zio_control *ctrl;
+	memcpy(ctrl, &zio_ctrl_template, __ZIO_CONTROL_SIZE);
+}
+EXPORT_SYMBOL(zio_init_control);
 
-	ctrl = kmem_cache_zalloc(zio_ctrl_slab, gfp);
+/* Magazines hold controls freed on this cpu: use them for local ones */
+struct zio_control *zio_alloc_control_node(gfp_t gfp, int node)
+{
+	struct zio_ctrl_mag *mag;
+	struct zio_control *ctrl = NULL;
+	unsigned long flags;
+
+	local_irq_save(flags);
+	mag = this_cpu_ptr(&zio_ctrl_mag);
+	if (node != NUMA_NO_NODE && node != numa_node_id()) {
+		mag->misses++;
+	} else if (mag->n) {
+		ctrl = mag->ctrl[--mag->n];
+		mag->hits++;
+	} else {
+		mag->misses++;
+	}
+	local_irq_restore(flags);
+
+	if (!ctrl)
+		ctrl = kmem_cache_alloc_node(zio_ctrl_slab, gfp, node);
 	if (!ctrl)
 		return NULL;
-
-	ctrl->major_version = zio_version_major(zio_version);
-	ctrl->minor_version = zio_version_minor(zio_version);
-	if (ntohl(1) == 1)
-		ctrl->flags |= ZIO_CONTROL_BIG_ENDIAN;
-	else
-		ctrl->flags |= ZIO_CONTROL_LITTLE_ENDIAN;
+	/* a recycled control is dirty: users rely on a clean one */
+	zio_init_control(ctrl);
 	return ctrl;
 }
+EXPORT_SYMBOL(zio_alloc_control_node);
+
+struct zio_control *zio_alloc_control(gfp_t gfp)
+{
+	return zio_alloc_control_node(gfp, NUMA_NO_NODE);
+}
 EXPORT_SYMBOL(zio_alloc_control);
 
 /* At control release time, we can copy it to sniffers, if configured so */
@@ -49,25 +89,81 @@ void __weak zio_sniffdev_add(struct zio_control *ctrl)
 {
 }
 
+int __weak zio_sniffdev_active(void)
+{
+	return 0;
+}
+
 void zio_free_control(struct zio_control *ctrl)
 {
-	zio_sniffdev_add(ctrl);
-	kmem_cache_free(zio_ctrl_slab, ctrl);
+	struct zio_ctrl_mag *mag;
+	unsigned long flags;
+
+	/*
+	 * Sniffing stays here: this is the last time the control is whole,
+	 * and deferring it would mean keeping it out of the magazine. With
+	 * no sniffer open, the cost is one list check.
+	 */
+	if (zio_sniffdev_active())
+		zio_sniffdev_add(ctrl);
+
+	local_irq_save(flags);
+	mag = this_cpu_ptr(&zio_ctrl_mag);
+	/* Only local controls: the magazine serves this node's requests */
+	if (mag->n < ZIO_CTRL_MAG_SIZE &&
+	    page_to_nid(virt_to_page(ctrl)) == numa_node_id()) {
+		mag->ctrl[mag->n++] = ctrl;
+		ctrl = NULL;
+	}
+	local_irq_restore(flags);
+
+	if (ctrl)
+		kmem_cache_free(zio_ctrl_slab, ctrl);
 }
 EXPORT_SYMBOL(zio_free_control);
 
+/* Used by the bus attributes, to show how effective the magazines are */
+void zio_ctrl_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+	struct zio_ctrl_mag *mag;
+	int cpu;
+
+	*hits = *misses = 0;
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(&zio_ctrl_mag, cpu);
+		*hits += mag->hits;
+		*misses += mag->misses;
+	}
+}
+
 int __init zio_slab_init(void)
 {
 	zio_ctrl_slab = KMEM_CACHE(zio_control, 0);
 	if (!zio_ctrl_slab)
 		return -ENOMEM;
+
+	zio_ctrl_template.major_version = zio_version_major(zio_version);
+	zio_ctrl_template.minor_version = zio_version_minor(zio_version);
+	if (ntohl(1) == 1)
+		zio_ctrl_template.flags |= ZIO_CONTROL_BIG_ENDIAN;
+	else
+		zio_ctrl_template.flags |= ZIO_CONTROL_LITTLE_ENDIAN;
 	return 0;
 }
 
 void zio_slab_exit(void) /* not __exit: called from zio_init on failures */
 {
-	if (zio_ctrl_slab)
-		kmem_cache_destroy(zio_ctrl_slab);
+	struct zio_ctrl_mag *mag;
+	int cpu;
+
+	if (!zio_ctrl_slab)
+		return;
+	for_each_possible_cpu(cpu) {
+		mag = per_cpu_ptr(&zio_ctrl_mag, cpu);
+		while (mag->n)
+			kmem_cache_free(zio_ctrl_slab, mag->ctrl[--mag->n]);
+	}
+	kmem_cache_destroy(zio_ctrl_slab);
 	return;
 }
 
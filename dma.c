@@ -17,28 +17,77 @@
 #include <linux/zio-dma.h>
 #include "zio-internal.h"
 
-static int zio_calculate_nents(struct zio_blocks_sg *sg_blocks,
-			       unsigned int n_blocks)
+/* Data flows from the device for input, towards it for output */
+static enum dma_data_direction zio_dma_dir(struct zio_channel *chan)
 {
+	if ((chan->cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return DMA_TO_DEVICE;
+	return DMA_FROM_DEVICE;
+}
+
+static struct page *zio_dma_page(void *bufp)
+{
+	if (is_vmalloc_addr(bufp))
+		return vmalloc_to_page(bufp);
+	return virt_to_page(bufp);
+}
+
+/*
+ * It returns the size of the segment starting at bufp: physically
+ * contiguous pages are merged, as long as the segment fits the device
+ * limits (maximum size and boundary). Both the functions below use it,
+ * so they agree on the number of entries.
+ */
+static int zio_dma_seg_len(struct device *hwdev, void *bufp, int bytesleft)
+{
+	unsigned long boundary = dma_get_seg_boundary(hwdev);
+	unsigned int max_seg = dma_get_max_seg_size(hwdev);
+	phys_addr_t start, next;
+	int mapbytes, chunk;
+
+	if (bytesleft < (PAGE_SIZE - offset_in_page(bufp)))
+		return bytesleft;
+	mapbytes = PAGE_SIZE - offset_in_page(bufp);
+	start = page_to_phys(zio_dma_page(bufp)) + offset_in_page(bufp);
+	while (mapbytes < bytesleft) {
+		next = page_to_phys(zio_dma_page(bufp + mapbytes));
+		if (next != start + mapbytes)
+			break; /* not contiguous */
+		chunk = min_t(int, bytesleft - mapbytes, PAGE_SIZE);
+		if (mapbytes + chunk > max_seg)
+			break;
+		if ((start & ~boundary) != ((next + chunk - 1) & ~boundary))
+			break;
+		mapbytes += chunk;
+	}
+	return mapbytes;
+}
+
+static int zio_calculate_nents(struct zio_dma_sgt *zdma)
+{
+	struct zio_blocks_sg *sg_blocks = zdma->sg_blocks;
 	int i, bytesleft;
 	void *bufp;
 	int mapbytes;
 	int nents = 0;
 
-	for (i = 0; i < n_blocks; ++i) {
+	zdma->nents_pages = 0;
+	for (i = 0; i < zdma->n_blocks; ++i) {
 		bytesleft = sg_blocks[i].block->datalen;
 		bufp = sg_blocks[i].block->data;
 		sg_blocks[i].first_nent = nents;
+		if (bytesleft)
+			zdma->nents_pages += DIV_ROUND_UP(offset_in_page(bufp) +
+							  bytesleft, PAGE_SIZE);
 		while (bytesleft) {
 			nents++;
-			if (bytesleft < (PAGE_SIZE - offset_in_page(bufp)))
-				mapbytes = bytesleft;
-			else
-				mapbytes = PAGE_SIZE - offset_in_page(bufp);
+			mapbytes = zio_dma_seg_len(zdma->hwdev, bufp, bytesleft);
 			bufp += mapbytes;
 			bytesleft -= mapbytes;
 		}
 	}
+	dev_dbg(zdma->hwdev, "%d sg entries for %d pages\n", nents,
+		zdma->nents_pages);
 	return nents;
 }
 
@@ -68,16 +117,11 @@ static void zio_dma_setup_scatter(struct zio_dma_sgt *zdma)
 		}
 
 		/*
-		 * If there are less bytes left than what fits
-		 * in the current page (plus page alignment offset)
-		 * we just feed in this, else we stuff in as much
-		 * as we can.
+		 * Feed in as much as we can: the rest of the current page
+		 * plus the following pages, if they are contiguous
 		 */
-		if (bytesleft < (PAGE_SIZE - offset_in_page(bufp)))
-			mapbytes = bytesleft;
-		else
-			mapbytes = PAGE_SIZE - offset_in_page(bufp);
-		/* Map the page */
+		mapbytes = zio_dma_seg_len(zdma->hwdev, bufp, bytesleft);
+		/* Map the page(s) */
 		if (is_vmalloc_addr(bufp))
 			sg_set_page(sg, vmalloc_to_page(bufp), mapbytes,
 				    offset_in_page(bufp));
@@ -123,6 +167,7 @@ struct zio_dma_sgt *zio_dma_alloc_sg(struct zio_channel *chan,
 	if (!zdma)
 		return ERR_PTR(-ENOMEM);
 	zdma->chan = chan;
+	zdma->dir = zio_dma_dir(chan);
 	/* Allocate a new list of blocks with sg information */
 	zdma->sg_blocks = kzalloc(sizeof(struct zio_blocks_sg) * n_blocks, gfp);
 	if (!zdma->sg_blocks) {
@@ -138,7 +183,7 @@ struct zio_dma_sgt *zio_dma_alloc_sg(struct zio_channel *chan,
 
 
 	/* calculate the number of necessary pages to transfer */
-	pages = zio_calculate_nents(zdma->sg_blocks, zdma->n_blocks);
+	pages = zio_calculate_nents(zdma);
 	if (!pages) {
 		err = -EINVAL;
 		goto out_calc_nents;
@@ -230,7 +275,7 @@ int zio_dma_map_sg(struct zio_dma_sgt *zdma, size_t page_desc_size,
 
 	/* Map DMA buffers */
 	sglen = dma_map_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
-			   DMA_FROM_DEVICE);
+			   zdma->dir);
 	if (!sglen) {
 		dev_err(zdma->hwdev, "cannot map dma SG memory\n");
 		goto out_map_sg;
@@ -272,7 +317,7 @@ int zio_dma_map_sg(struct zio_dma_sgt *zdma, size_t page_desc_size,
 
 out_fill_desc:
 	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
-		     DMA_FROM_DEVICE);
+		     zdma->dir);
 out_map_sg:
 	dma_unmap_single(zdma->hwdev, zdma->dma_page_desc_pool, size,
 			 DMA_TO_DEVICE);
@@ -296,7 +341,7 @@ void zio_dma_unmap_sg(struct zio_dma_sgt *zdma)
 
 	size = zdma->page_desc_size * zdma->sgt.nents;
 	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
-		     DMA_FROM_DEVICE);
+		     zdma->dir);
 	dma_unmap_single(zdma->hwdev, zdma->dma_page_desc_pool, size,
 			 DMA_TO_DEVICE);
 	kfree(zdma->page_desc_pool);
@@ -304,3 +349,320 @@ void zio_dma_unmap_sg(struct zio_dma_sgt *zdma)
 	zdma->page_desc_pool = NULL;
 }
 EXPORT_SYMBOL(zio_dma_unmap_sg);
+
+
+/*
+ * zio_dma_sync_for_device
+ * @zdma: zio DMA descriptor from zio_dma_alloc_sg(), mapped
+ *
+ * It gives the blocks back to the device, after the cpu accessed them
+ * (e.g. new samples for output), so they can be transferred again without
+ * unmapping and mapping them.
+ */
+void zio_dma_sync_for_device(struct zio_dma_sgt *zdma)
+{
+	dma_sync_sg_for_device(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
+			       zdma->dir);
+}
+EXPORT_SYMBOL(zio_dma_sync_for_device);
+
+
+/*
+ * zio_dma_sync_for_cpu
+ * @zdma: zio DMA descriptor from zio_dma_alloc_sg(), mapped
+ *
+ * It gives the blocks to the cpu, after a transfer is over, while
+ * keeping them mapped.
+ */
+void zio_dma_sync_for_cpu(struct zio_dma_sgt *zdma)
+{
+	dma_sync_sg_for_cpu(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
+			    zdma->dir);
+}
+EXPORT_SYMBOL(zio_dma_sync_for_cpu);
+
+
+/*
+ * zio_dma_alloc_area
+ * @chan: zio channel associated to this area
+ * @hwdev: low level device responsible of the DMA
+ * @base: the buffer memory (kmalloc, vmalloc or pages), see zio_bi_area()
+ * @size: size of the buffer memory
+ * @page_desc_size: the size (in byte) of the dma transfer descriptor of the
+ *                  specific hw
+ * @gfp: gfp flags for memory allocation
+ *
+ * It builds and maps, once, the scatterlist for a whole buffer area, and
+ * the pool of transfer descriptors. Then, each transfer only fills the
+ * descriptors of its own block with zio_dma_fill_area(). Only one transfer
+ * at a time can use the area, because they share the descriptors.
+ * Buffers may replace their area (e.g. vmalloc, on resize): they call
+ * bi->area_change before releasing the old one, and the driver must free
+ * this mapping there and map the new area. Blocks allocated before the
+ * change are outside the new mapping: zio_dma_fill_area() refuses them.
+ */
+struct zio_dma_sgt *zio_dma_alloc_area(struct zio_channel *chan,
+				       struct device *hwdev,
+				       void *base, size_t size,
+				       size_t page_desc_size, gfp_t gfp)
+{
+	struct zio_dma_sgt *zdma;
+	struct scatterlist *sg;
+	unsigned long off = 0;
+	unsigned int i, nents;
+	int err;
+
+	if (unlikely(!chan || !hwdev || !base || !size || !page_desc_size))
+		return ERR_PTR(-EINVAL);
+
+	zdma = kzalloc(sizeof(struct zio_dma_sgt), gfp);
+	if (!zdma)
+		return ERR_PTR(-ENOMEM);
+	zdma->chan = chan;
+	zdma->dir = zio_dma_dir(chan);
+	zdma->hwdev = hwdev;
+	zdma->page_desc_size = page_desc_size;
+	/* The whole area is described as a single block */
+	zdma->area.data = base;
+	zdma->area.datalen = size;
+	zdma->sg_blocks = kzalloc(sizeof(struct zio_blocks_sg), gfp);
+	if (!zdma->sg_blocks) {
+		err = -ENOMEM;
+		goto out;
+	}
+	zdma->sg_blocks[0].block = &zdma->area;
+	zdma->n_blocks = 1;
+
+	nents = zio_calculate_nents(zdma);
+	err = sg_alloc_table(&zdma->sgt, nents, gfp);
+	if (err)
+		goto out_alloc_sg;
+	zio_dma_setup_scatter(zdma);
+
+	zdma->sglen = dma_map_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
+				 zdma->dir);
+	if (!zdma->sglen) {
+		dev_err(zdma->hwdev, "cannot map dma SG memory\n");
+		err = -ENOMEM;
+		goto out_map_sg;
+	}
+
+	/* Offset of each mapped segment, to find a block with a bsearch */
+	zdma->seg_off = kcalloc(zdma->sglen, sizeof(*zdma->seg_off), gfp);
+	if (!zdma->seg_off) {
+		err = -ENOMEM;
+		goto out_seg_off;
+	}
+	for_each_sg(zdma->sgt.sgl, sg, zdma->sglen, i) {
+		zdma->seg_off[i] = off;
+		off += sg_dma_len(sg);
+	}
+	/* Syncing works on the entries as built, not on mapped segments */
+	zdma->ent_off = kcalloc(zdma->sgt.nents, sizeof(*zdma->ent_off), gfp);
+	if (!zdma->ent_off) {
+		err = -ENOMEM;
+		goto out_pool;
+	}
+	off = 0;
+	for_each_sg(zdma->sgt.sgl, sg, zdma->sgt.nents, i) {
+		zdma->ent_off[i] = off;
+		off += sg->length;
+	}
+
+	/* A block can't span more segments than the whole area */
+	zdma->page_desc_pool = kcalloc(zdma->sglen, page_desc_size, gfp);
+	if (!zdma->page_desc_pool) {
+		err = -ENOMEM;
+		goto out_pool;
+	}
+	zdma->dma_page_desc_pool = dma_map_single(zdma->hwdev,
+						  zdma->page_desc_pool,
+						  page_desc_size * zdma->sglen,
+						  DMA_TO_DEVICE);
+	if (dma_mapping_error(zdma->hwdev, zdma->dma_page_desc_pool)) {
+		dev_err(zdma->hwdev, "cannot map dma memory for descriptors\n");
+		err = -ENOMEM;
+		goto out_map_single;
+	}
+
+	return zdma;
+
+out_map_single:
+	kfree(zdma->page_desc_pool);
+out_pool:
+	kfree(zdma->ent_off);
+	kfree(zdma->seg_off);
+out_seg_off:
+	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
+		     zdma->dir);
+out_map_sg:
+	sg_free_table(&zdma->sgt);
+out_alloc_sg:
+	kfree(zdma->sg_blocks);
+out:
+	kfree(zdma);
+	return ERR_PTR(err);
+}
+EXPORT_SYMBOL(zio_dma_alloc_area);
+
+
+/*
+ * zio_dma_free_area
+ * @zdma: zio DMA descriptor from zio_dma_alloc_area()
+ *
+ * It unmaps and releases the area mapping
+ */
+void zio_dma_free_area(struct zio_dma_sgt *zdma)
+{
+	dma_unmap_single(zdma->hwdev, zdma->dma_page_desc_pool,
+			 zdma->page_desc_size * zdma->sglen, DMA_TO_DEVICE);
+	dma_unmap_sg(zdma->hwdev, zdma->sgt.sgl, zdma->sgt.nents,
+		     zdma->dir);
+	kfree(zdma->page_desc_pool);
+	kfree(zdma->ent_off);
+	kfree(zdma->seg_off);
+	zio_dma_free_sg(zdma);
+}
+EXPORT_SYMBOL(zio_dma_free_area);
+
+
+/* The segment or entry containing off, given the offsets of all of them */
+static unsigned int zio_dma_area_find(struct zio_dma_sgt *zdma,
+				      unsigned long *offs, unsigned int n,
+				      unsigned long off,
+				      struct scatterlist **sgp)
+{
+	struct scatterlist *sg;
+	unsigned int lo, hi, mid, i;
+
+	lo = 0;
+	hi = n;
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (offs[mid] <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	sg = zdma->sgt.sgl;
+	for (i = 0; i < lo; i++)
+		sg = sg_next(sg);
+	*sgp = sg;
+	return lo;
+}
+
+static unsigned int zio_dma_area_seg(struct zio_dma_sgt *zdma,
+				     unsigned long off,
+				     struct scatterlist **sgp)
+{
+	return zio_dma_area_find(zdma, zdma->seg_off, zdma->sglen, off, sgp);
+}
+
+/*
+ * The DMA API syncs what dma_map_sg() got, entry by entry: sync the
+ * entries covering the block, which may extend a little past it
+ */
+static void zio_dma_area_sync(struct zio_dma_sgt *zdma, unsigned long off,
+			      unsigned long end, int for_device)
+{
+	struct scatterlist *sg;
+	unsigned int i, n;
+
+	i = zio_dma_area_find(zdma, zdma->ent_off, zdma->sgt.nents, off, &sg);
+	for (n = 1; i + n < zdma->sgt.nents && zdma->ent_off[i + n] < end; n++)
+		;
+	if (for_device)
+		dma_sync_sg_for_device(zdma->hwdev, sg, n, zdma->dir);
+	else
+		dma_sync_sg_for_cpu(zdma->hwdev, sg, n, zdma->dir);
+}
+
+/*
+ * zio_dma_fill_area
+ * @zdma: zio DMA descriptor from zio_dma_alloc_area()
+ * @block: the block to transfer, within the area
+ * @dev_mem_off: device memory offset where retrieve data for this block
+ * @fill_desc: callback for the driver in order to fill each transfer
+ *             descriptor
+ *
+ * It selects the segments of the area covered by the block, and fills the
+ * transfer descriptors from the first one of the pool. The scatterlist
+ * passed to fill_desc only covers the block, so the first and last ones
+ * may be a part of a mapped segment. On success, zdma->n_desc is the
+ * number of descriptors in use. Nothing is allocated or mapped here.
+ */
+int zio_dma_fill_area(struct zio_dma_sgt *zdma, struct zio_block *block,
+		      uint32_t dev_mem_off,
+		      int (*fill_desc)(struct zio_dma_sg *zsg))
+{
+	unsigned long off, end, delta, len;
+	struct scatterlist *sg, cur;
+	unsigned int i;
+	struct zio_dma_sg zsg;
+	int err;
+
+	if (unlikely(!zdma || !zdma->seg_off || !block || !fill_desc))
+		return -EINVAL;
+	if (block->data < zdma->area.data ||
+	    block->data + block->datalen > zdma->area.data + zdma->area.datalen)
+		return -EINVAL;
+	off = block->data - zdma->area.data;
+	end = off + block->datalen;
+
+	zdma->sg_blocks[0].block = block;
+	zdma->sg_blocks[0].dev_mem_off = dev_mem_off;
+	zdma->n_desc = 0;
+	zio_dma_area_sync(zdma, off, end, 1);
+	i = zio_dma_area_seg(zdma, off, &sg);
+	for (; i < zdma->sglen && off < end; i++, sg = sg_next(sg)) {
+		delta = off - zdma->seg_off[i];
+		len = min_t(unsigned long, sg_dma_len(sg) - delta, end - off);
+
+		cur = *sg;
+		sg_dma_address(&cur) = sg_dma_address(sg) + delta;
+		sg_dma_len(&cur) = len;
+
+		zsg.zsgt = zdma;
+		zsg.sg = &cur;
+		zsg.dev_mem_off = dev_mem_off;
+		zsg.page_desc = zdma->page_desc_pool +
+				zdma->page_desc_size * zdma->n_desc;
+		zsg.block_idx = 1;
+		zsg.page_idx = zdma->n_desc;
+		err = fill_desc(&zsg);
+		if (err) {
+			dev_err(zdma->hwdev, "Cannot fill descriptor %d\n",
+				zdma->n_desc);
+			return err;
+		}
+
+		zdma->n_desc++;
+		dev_mem_off += len;
+		off += len;
+	}
+
+	/* Descriptors are written by the cpu and read by the device */
+	dma_sync_single_for_device(zdma->hwdev, zdma->dma_page_desc_pool,
+				   zdma->page_desc_size * zdma->n_desc,
+				   DMA_TO_DEVICE);
+	return 0;
+}
+EXPORT_SYMBOL(zio_dma_fill_area);
+
+
+/*
+ * zio_dma_done_area
+ * @zdma: zio DMA descriptor from zio_dma_alloc_area()
+ *
+ * It gives the block of the last zio_dma_fill_area() back to the cpu,
+ * once the transfer is over.
+ */
+void zio_dma_done_area(struct zio_dma_sgt *zdma)
+{
+	struct zio_block *block = zdma->sg_blocks[0].block;
+	unsigned long off;
+
+	off = block->data - zdma->area.data;
+	zio_dma_area_sync(zdma, off, off + block->datalen, 0);
+}
+EXPORT_SYMBOL(zio_dma_done_area);
@@ -10,6 +10,7 @@
 #include <linux/init.h>
 #include <linux/types.h>
 #include <linux/delay.h>
+#include <linux/file.h>
 
 #include <linux/zio.h>
 #include <linux/zio-sysfs.h>
@@ -29,6 +30,29 @@ static void __zio_internal_abort_free(struct zio_cset *cset)
 	}
 }
 
+/*
+ * Active and queued blocks are released whenever the trigger is aborted
+ * or disabled: data_done may have left the next one active, and it must
+ * not survive a change of buffer or block size. Called with cset lock.
+ */
+static void __zio_internal_chan_free(struct zio_channel *chan)
+{
+	struct zio_block *block;
+
+	zio_buffer_free_block(chan->bi, chan->active_block);
+	chan->active_block = NULL;
+	while ((block = zio_chan_dequeue(chan)))
+		zio_buffer_free_block(chan->bi, block);
+}
+
+static void __zio_internal_queue_free(struct zio_cset *cset)
+{
+	int i;
+
+	for (i = 0; i < cset->n_chan; ++i)
+		__zio_internal_chan_free(cset->chan + i);
+}
+
 /*
  * zio_trigger_abort
  * This is a ZIO helper to invoke the abort function. This must be used when
@@ -67,6 +91,8 @@ int __zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 			__zio_internal_abort_free(cset);
 		ti->flags &= (~ZIO_TI_ARMED);
 	}
+	if ((ret & ZIO_TI_ARMED) || disable)
+		__zio_internal_queue_free(cset);
 	if (disable)
 		ti->flags |= ZIO_DISABLED;
 	spin_unlock_irqrestore(&cset->lock, flags);
@@ -82,21 +108,37 @@ static int __zio_arm_input_trigger(struct zio_ti *ti)
 	struct zio_cset *cset;
 	struct zio_channel *chan;
 	struct zio_control *ctrl;
+	unsigned long flags;
 	int i, datalen;
 
 	cset = ti->cset;
 	zdev = cset->zdev;
 	zbuf = cset->zbuf;
 
-	/* Allocate the buffer for the incoming sample, in active channels */
+	/*
+	 * Allocate the buffer for the incoming sample, in active channels.
+	 * With a queue, the active block may come from the previous event,
+	 * whose data_done can run at any time: so take the lock.
+	 */
+	spin_lock_irqsave(&cset->lock, flags);
 	chan_for_each(chan, cset) {
 		ctrl = chan->current_ctrl;
 		ctrl->nsamples = ti->nsamples;
 		datalen = ctrl->ssize * ti->nsamples;
-		block = zio_buffer_alloc_block(chan->bi, datalen, GFP_ATOMIC);
+		/* A block left by the previous event must fit this one */
+		if (chan->active_block && chan->active_block->datalen != datalen)
+			__zio_internal_chan_free(chan);
 		/* If alloc error, it is reported at data_done time */
-		chan->active_block = block;
+		if (!chan->active_block)
+			chan->active_block = zio_buffer_alloc_block(chan->bi,
+							datalen, GFP_ATOMIC);
+		while (chan->active_block &&
+		       chan->q_len + 1 < cset->queue_depth &&
+		       (block = zio_buffer_alloc_block(chan->bi, datalen,
+						       GFP_ATOMIC)))
+			zio_chan_enqueue(chan, block);
 	}
+	spin_unlock_irqrestore(&cset->lock, flags);
 	i = cset->raw_io(cset);
 
 	return i;
@@ -151,13 +193,12 @@ void zio_arm_trigger(struct zio_ti *ti)
 			dev_err(&ti->head.dev,
 				"raw_io failed (%i), cannot arm trigger\n",
 				ret);
-			chan_for_each(chan, ti->cset) {
-				zio_buffer_free_block(chan->bi,
-						      chan->active_block);
-				chan->active_block = NULL;
+			spin_lock_irqsave(&ti->cset->lock, flags);
+			__zio_internal_queue_free(ti->cset);
+			chan_for_each(chan, ti->cset)
 				chan->current_ctrl->zio_alarms |=
 							ZIO_ALARM_LOST_TRIGGER;
-			}
+			spin_unlock_irqrestore(&ti->cset->lock, flags);
 		}
 
 		/* error or -EGAINA */
@@ -204,6 +245,7 @@ static int __zio_trigger_data_done(struct zio_cset *cset)
 		must_rearm = zio_generic_data_done(cset);
 
 	cset->ti->flags &= ~ZIO_TI_ARMED;
+	cset->done_gen++; /* the gather cdev waits for whole events */
 	spin_unlock_irqrestore(&cset->lock, flags);
 
 	return must_rearm;
@@ -221,14 +263,233 @@ int zio_trigger_data_done(struct zio_cset *cset)
 EXPORT_SYMBOL(zio_trigger_data_done);
 
 
+/*
+ * Deferred data_done: in the caller's context (often an interrupt) the
+ * completed input blocks only get the head of the control, as it is at
+ * this event, and they are parked in the channel. The cset work attaches
+ * the attributes and stores them, in batches, with interrupts enabled.
+ * If the channel can't park more blocks, the new one is lost.
+ */
+void zio_defer_block(struct zio_channel *chan, struct zio_block *block)
+{
+	if (chan->d_len == ZIO_DONE_MAX) {
+		chan->current_ctrl->zio_alarms |= ZIO_ALARM_LOST_BLOCK;
+		zio_buffer_free_block(chan->bi, block);
+		return;
+	}
+	memcpy(zio_get_ctrl(block), chan->current_ctrl,
+	       __ZIO_CONTROL_HEAD_SIZE);
+	chan->done[(chan->d_first + chan->d_len++) % ZIO_DONE_MAX] = block;
+}
+EXPORT_SYMBOL(zio_defer_block);
+
+/* Called with the cset lock held, after zio_defer_block() */
+void zio_defer_done(struct zio_cset *cset, int rearm)
+{
+	if (rearm)
+		cset->flags |= ZIO_CSET_DONE_REARM;
+	schedule_work(&cset->done_work);
+}
+EXPORT_SYMBOL(zio_defer_done);
+
+static void zio_done_store(struct zio_channel *chan, struct zio_block *block)
+{
+	struct zio_control *ctrl = zio_get_ctrl(block);
+	unsigned long flags;
+
+	/* The head is from zio_defer_block(), attributes are current */
+	spin_lock_irqsave(&chan->cset->lock, flags);
+	memcpy((void *)ctrl + __ZIO_CONTROL_HEAD_SIZE,
+	       (void *)chan->current_ctrl + __ZIO_CONTROL_HEAD_SIZE,
+	       __ZIO_CONTROL_SIZE - __ZIO_CONTROL_HEAD_SIZE);
+	spin_unlock_irqrestore(&chan->cset->lock, flags);
+	zio_buffer_store_block(chan->bi, block);
+}
+
+void zio_done_work(struct work_struct *work)
+{
+	struct zio_cset *cset = container_of(work, struct zio_cset, done_work);
+	struct zio_block *block[ZIO_DONE_MAX];
+	struct zio_channel *chan;
+	unsigned long flags;
+	int i, j, n, rearm;
+
+	for (i = 0; i < cset->n_chan; ++i) {
+		chan = cset->chan + i;
+		spin_lock_irqsave(&cset->lock, flags);
+		for (n = 0; chan->d_len; ++n, --chan->d_len) {
+			block[n] = chan->done[chan->d_first];
+			chan->d_first = (chan->d_first + 1) % ZIO_DONE_MAX;
+		}
+		spin_unlock_irqrestore(&cset->lock, flags);
+		for (j = 0; j < n; ++j)
+			zio_done_store(chan, block[j]);
+	}
+
+	spin_lock_irqsave(&cset->lock, flags);
+	rearm = cset->flags & ZIO_CSET_DONE_REARM;
+	cset->flags &= ~ZIO_CSET_DONE_REARM;
+	cset->done_gen++;
+	spin_unlock_irqrestore(&cset->lock, flags);
+	if (rearm)
+		zio_arm_trigger(cset->ti);
+}
+
+/*
+ * By default a sleeping reader is woken when a block enters an empty
+ * buffer. With a watermark (wake_blocks or wake_bytes), it is woken when
+ * enough data is pending, or when wake_usecs elapsed since the first
+ * pending block, so it reads in batches with a bounded latency. The
+ * bound is never missing: a watermark alone would leave the last blocks
+ * of an acquisition pending forever.
+ * A bound eventfd is signalled at the same time, with the block count.
+ */
+static void zio_bi_signal(struct zio_bi *bi, unsigned int nblocks)
+{
+	unsigned long flags;
+
+	if (!READ_ONCE(bi->efd) || !nblocks)
+		return;
+	spin_lock_irqsave(&bi->lock, flags);
+	if (bi->efd) {
+#if KERNEL_VERSION(6, 8, 0) > LINUX_VERSION_CODE
+		eventfd_signal(bi->efd, nblocks);
+#else
+		while (nblocks--)
+			eventfd_signal(bi->efd);
+#endif
+	}
+	spin_unlock_irqrestore(&bi->lock, flags);
+}
+
+static void __zio_bi_wake(struct zio_bi *bi)
+{
+	int nblocks = atomic_xchg(&bi->wake_nblocks, 0);
+
+	atomic_set(&bi->wake_nbytes, 0);
+	wake_up_interruptible(&bi->q);
+	wake_up_interruptible(&bi->cset->gather_q);
+	zio_bi_signal(bi, nblocks);
+}
+
+enum hrtimer_restart zio_bi_wake_timer(struct hrtimer *timer)
+{
+	__zio_bi_wake(container_of(timer, struct zio_bi, wake_timer));
+	return HRTIMER_NORESTART;
+}
+
+void zio_bi_wake_reader(struct zio_bi *bi, size_t datalen, int first)
+{
+	unsigned int blocks = READ_ONCE(bi->wake_blocks);
+	unsigned int bytes = READ_ONCE(bi->wake_bytes);
+	unsigned int usecs = READ_ONCE(bi->wake_usecs);
+	int nblocks, nbytes;
+
+	if (blocks <= 1 && !bytes) {
+		if (first) {
+			wake_up_interruptible(&bi->q);
+			wake_up_interruptible(&bi->cset->gather_q);
+		}
+		zio_bi_signal(bi, 1);
+		return;
+	}
+
+	nblocks = atomic_inc_return(&bi->wake_nblocks);
+	nbytes = atomic_add_return(datalen, &bi->wake_nbytes);
+	if ((blocks > 1 && nblocks >= blocks) || (bytes && nbytes >= bytes)) {
+		hrtimer_try_to_cancel(&bi->wake_timer);
+		__zio_bi_wake(bi);
+	} else if (nblocks == 1) {
+		if (!usecs)
+			usecs = ZIO_WAKE_USECS_DEFAULT;
+		hrtimer_start(&bi->wake_timer, ktime_set(0, usecs * 1000),
+			      HRTIMER_MODE_REL);
+	}
+}
+EXPORT_SYMBOL(zio_bi_wake_reader);
+
+/*
+ * Bind the eventfd of the calling process, or unbind if fd is negative.
+ * The signal path runs under bi->lock, so the old context can be put.
+ */
+static void __zio_bi_bind_eventfd(struct zio_bi *bi, struct eventfd_ctx *ctx)
+{
+	struct eventfd_ctx *old;
+	unsigned long flags;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	old = bi->efd;
+	bi->efd = ctx;
+	spin_unlock_irqrestore(&bi->lock, flags);
+	if (old)
+		eventfd_ctx_put(old);
+}
+
+int zio_bi_set_eventfd(struct zio_bi *bi, int fd)
+{
+	struct eventfd_ctx *ctx = NULL;
+
+	if (fd >= 0) {
+		ctx = eventfd_ctx_fdget(fd);
+		if (IS_ERR(ctx))
+			return PTR_ERR(ctx);
+	}
+	__zio_bi_bind_eventfd(bi, ctx);
+	return 0;
+}
+EXPORT_SYMBOL(zio_bi_set_eventfd);
+
+/*
+ * The same, for all the channels of a cset: the file is looked up once
+ * and checked before binding, so either all channels change or none.
+ */
+int zio_cset_set_eventfd(struct zio_cset *cset, int fd)
+{
+	struct eventfd_ctx *ctx;
+	struct file *file = NULL;
+	int i;
+
+	if (fd >= 0) {
+		file = fget(fd);
+		if (!file)
+			return -EBADF;
+		ctx = eventfd_ctx_fileget(file);
+		if (IS_ERR(ctx)) {
+			fput(file);
+			return PTR_ERR(ctx);
+		}
+		eventfd_ctx_put(ctx);
+	}
+	/* Each channel holds its own reference, that can't fail now */
+	for (i = 0; i < cset->n_chan; ++i)
+		__zio_bi_bind_eventfd(cset->chan[i].bi,
+				      file ? eventfd_ctx_fileget(file) : NULL);
+	if (file)
+		fput(file);
+	return 0;
+}
+EXPORT_SYMBOL(zio_cset_set_eventfd);
+
 int zio_generic_push_block(struct zio_ti *ti,
 			   struct zio_channel *chan,
 			   struct zio_block *block)
 {
-	if (chan->active_block)
+	unsigned long flags;
+	int err;
+
+	if (!chan->active_block) {
+		chan->active_block = block;
+		return 0;
+	}
+	/*
+	 * Queue it after the active one. We hold the buffer lock, so we
+	 * can't wait for data_done: if it runs, it retrieves the block.
+	 */
+	if (!spin_trylock_irqsave(&chan->cset->lock, flags))
 		return -EBUSY;
-	chan->active_block = block;
+	err = zio_chan_enqueue(chan, block);
+	spin_unlock_irqrestore(&chan->cset->lock, flags);
 
-	return 0;
+	return err;
 }
 EXPORT_SYMBOL(zio_generic_push_block);
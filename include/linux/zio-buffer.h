@@ -11,12 +11,16 @@
 #include <linux/mm.h>
 #include <linux/list.h>
 #include <linux/spinlock.h>
+#include <linux/mutex.h>
 #include <linux/wait.h>
+#include <linux/eventfd.h>
+#include <linux/hrtimer.h>
 
 #include <linux/zio.h>
 #include <linux/zio-user.h>
 
 #define ZIO_DEFAULT_BUFFER "kmalloc" /* For devices with no own buffer type */
+#define ZIO_WAKE_USECS_DEFAULT 10000 /* Latency bound of watermarks */
 
 /*
  * The following structure defines a buffer type, with methods.
@@ -27,7 +31,7 @@ struct zio_buffer_type {
 	struct zio_obj_head	head;
 	struct module		*owner;
 	struct list_head	list; /* instances, and list lock */
-	spinlock_t		lock;
+	struct mutex		lock; /* create may sleep */
 	unsigned long		flags;
 
 	const struct zio_sysfs_operations	*s_op;
@@ -47,6 +51,8 @@ struct zio_buffer_type {
 
 /* buffer_type->flags */
 #define ZIO_BUF_FLAG_ALLOC_FOPS	0x00000001 /* set by zio-core */
+#define ZIO_BUF_FLAG_SPLICE	0x00000002 /* block data is in pages */
+#define ZIO_BUF_FLAG_SINGLE	0x00000004 /* one block allocated at a time */
 
 extern const struct file_operations zio_generic_file_operations;
 
@@ -58,7 +64,15 @@ void zio_unregister_buf(struct zio_buffer_type *zbuf);
 int zio_slab_init(void);
 void zio_slab_exit(void);
 struct zio_control *zio_alloc_control(gfp_t gfp);
+struct zio_control *zio_alloc_control_node(gfp_t gfp, int node);
 void zio_free_control(struct zio_control *ctrl);
+void zio_init_control(struct zio_control *ctrl);
+
+/* Buffers call this after storing an input block (in helpers.c) */
+void zio_bi_wake_reader(struct zio_bi *bi, size_t datalen, int first);
+enum hrtimer_restart zio_bi_wake_timer(struct hrtimer *timer);
+int zio_bi_set_eventfd(struct zio_bi *bi, int fd);
+int zio_cset_set_eventfd(struct zio_cset *cset, int fd);
 
 
 struct zio_bi {
@@ -72,6 +86,20 @@ struct zio_bi {
 	wait_queue_head_t q;			/* for reading or writing */
 	spinlock_t		lock;
 	atomic_t		use_count;
+	int			node;		/* NUMA node for allocations */
+	atomic_t		nready;		/* stored blocks, for poll */
+
+	/* Input readers are woken in batches, see zio_bi_wake_reader() */
+	unsigned int		wake_blocks;	/* 0: when the first arrives */
+	unsigned int		wake_bytes;	/* 0: no byte threshold */
+	unsigned int		wake_usecs;	/* 0: ZIO_WAKE_USECS_DEFAULT */
+	atomic_t		wake_nblocks;	/* stored since last wake-up */
+	atomic_t		wake_nbytes;
+	struct hrtimer		wake_timer;
+	struct eventfd_ctx	*efd;		/* signalled too, under lock */
+
+	/* Set by drivers that map the area once, see zio_dma_alloc_area() */
+	void			(*area_change)(struct zio_bi *bi);
 
 	/* Standard and extended attributes for this object */
 	struct zio_attribute_set		zattr_set;
@@ -90,8 +118,18 @@ enum zio_bi_flag_mask {
 				  (e.g. buffer is full ) */
 	/* Configuration */
 	ZIO_BI_PREF_NEW = 0x100, /**< prefer new blocks instead old ones */
+	ZIO_BI_MMAP_OUTPUT = 0x200, /**< output data is written in the map */
 };
 
+/**
+ * The default NUMA node of a buffer instance is the one of the device.
+ * Buffers use it at create time, as bi->node is set by the caller.
+ */
+static inline int zio_chan_to_node(struct zio_channel *chan)
+{
+	return dev_to_node(&chan->cset->zdev->head.dev);
+}
+
 /**
  * This helper returns the value of a sysfs attribute of a buffer instance
  */
@@ -135,8 +173,42 @@ struct zio_buffer_operations {
 	struct zio_bi *		(*create)(struct zio_buffer_type *zbuf,
 					  struct zio_channel *chan);
 	void			(*destroy)(struct zio_bi *bi);
+
+	/* Optional: populate the whole vma at mmap time, after v_op->open */
+	int			(*mmap)(struct zio_bi *bi,
+					struct vm_area_struct *vma);
+
+	/*
+	 * Optional: number of stored blocks, if cheaper than keeping
+	 * bi->nready. Buffers without it update bi->nready when blocks
+	 * enter or leave their queue. It must not sleep; it may take
+	 * bi->lock, which callers never hold.
+	 */
+	unsigned int		(*nready)(struct zio_bi *bi);
+
+	/*
+	 * Optional: the memory all blocks come from, for drivers that map
+	 * it once. If the buffer replaces it, it calls bi->area_change in
+	 * process context, before the old area is released.
+	 */
+	int			(*area)(struct zio_bi *bi, void **base,
+					size_t *size);
 };
 
+static inline unsigned int zio_bi_nready(struct zio_bi *bi)
+{
+	if (bi->b_op->nready)
+		return bi->b_op->nready(bi);
+	return atomic_read(&bi->nready);
+}
+
+static inline int zio_bi_area(struct zio_bi *bi, void **base, size_t *size)
+{
+	if (!bi->b_op->area)
+		return -EOPNOTSUPP;
+	return bi->b_op->area(bi, base, size);
+}
+
 /*
  * This is the structure we place in f->private_data at open time.
  * Note that the buffer_create function is called by zio-core.
@@ -144,10 +216,13 @@ struct zio_buffer_operations {
 enum zio_cdev_type {
 	ZIO_CDEV_CTRL,
 	ZIO_CDEV_DATA,
+	ZIO_CDEV_COMBINED,	/* control followed by data, input only */
 };
+struct zio_consumer;
 struct zio_f_priv {
 	struct zio_channel *chan; /* where current block and buffer live */
 	enum zio_cdev_type type;
+	struct zio_consumer *cons; /* shared-read cursor, if any */
 };
 
 /* Buffer helpers */
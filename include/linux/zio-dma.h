@@ -10,6 +10,7 @@
 
 #include <linux/zio.h>
 #include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
 
 /**
  * It describe a zio block to be mapped with sg
@@ -27,22 +28,39 @@ struct zio_blocks_sg {
 /**
  * it describes the DMA sg mapping
  * @hwdev: the low level driver which will do DMA
+ * @dir: direction of data, from the channel-set direction
  * @sg_blocks: one or more blocks to map
  * @n_blocks: number of blocks to map
  * @sgt: scatter gather table
+ * @nents_pages: entries @sgt would need without merging contiguous pages
  * @page_desc_size: size of the transfer descriptor
  * @page_desc_pool: vector of transfer descriptors
  * @dma_page_desc_pool: dma address of the vector of transfer descriptors
+ *
+ * The following fields are only used for persistent area mappings
+ * @area: the whole buffer area, described as a block
+ * @sglen: number of mapped segments in @sgt
+ * @seg_off: offset of each mapped segment within the area
+ * @ent_off: offset of each entry of @sgt within the area, for syncing
+ * @n_desc: number of descriptors filled for the current transfer
  */
 struct zio_dma_sgt {
 	struct zio_channel *chan;
 	struct device *hwdev;
+	enum dma_data_direction dir;
 	struct zio_blocks_sg *sg_blocks;
 	unsigned int n_blocks;
 	struct sg_table sgt;
+	unsigned int nents_pages;
 	size_t page_desc_size;
 	void *page_desc_pool;
 	dma_addr_t dma_page_desc_pool;
+
+	struct zio_block area;
+	unsigned int sglen;
+	unsigned long *seg_off;
+	unsigned long *ent_off;
+	unsigned int n_desc;
 };
 
 /**
@@ -74,5 +92,18 @@ extern void zio_dma_free_sg(struct zio_dma_sgt *zdma);
 extern int zio_dma_map_sg(struct zio_dma_sgt *zdma, size_t page_desc_size,
 			  int (*fill_desc)(struct zio_dma_sg *zsg));
 extern void zio_dma_unmap_sg(struct zio_dma_sgt *zdma);
+extern void zio_dma_sync_for_device(struct zio_dma_sgt *zdma);
+extern void zio_dma_sync_for_cpu(struct zio_dma_sgt *zdma);
+
+extern struct zio_dma_sgt *zio_dma_alloc_area(struct zio_channel *chan,
+					      struct device *hwdev,
+					      void *base, size_t size,
+					      size_t page_desc_size,
+					      gfp_t gfp);
+extern void zio_dma_free_area(struct zio_dma_sgt *zdma);
+extern int zio_dma_fill_area(struct zio_dma_sgt *zdma,
+			     struct zio_block *block, uint32_t dev_mem_off,
+			     int (*fill_desc)(struct zio_dma_sg *zsg));
+extern void zio_dma_done_area(struct zio_dma_sgt *zdma);
 
 #endif /* ZIO_HELPERS_H_ */
@@ -129,6 +129,11 @@ int __zio_trigger_abort_disable(struct zio_cset *cset, int disable);
 int zio_generic_push_block(struct zio_ti *ti,struct zio_channel *chan,
 			   struct zio_block *block);
 
+/* Deferred input data_done (ZIO_CSET_DEFER_DONE), in helpers.c */
+void zio_defer_block(struct zio_channel *chan, struct zio_block *block);
+void zio_defer_done(struct zio_cset *cset, int rearm);
+void zio_done_work(struct work_struct *work);
+
 /* This can only be called in non-atomic context */
 static inline int zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 {
@@ -141,6 +146,42 @@ static inline int zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 	return ret;
 }
 
+/*
+ * With a queue-depth greater than 1, each channel has up to depth - 1
+ * blocks queued after active_block. Drivers may give them to hardware in
+ * advance (see zio_chan_queued), and they must complete them in order:
+ * data_done makes the first queued block the active one. The queue is
+ * protected by the cset spin lock.
+ */
+static inline struct zio_block *zio_chan_queued(struct zio_channel *chan,
+						unsigned int n)
+{
+	if (n >= chan->q_len)
+		return NULL;
+	return chan->queue[(chan->q_first + n) % ZIO_QUEUE_MAX];
+}
+
+static inline int zio_chan_enqueue(struct zio_channel *chan,
+				   struct zio_block *block)
+{
+	if (chan->q_len + 1 >= chan->cset->queue_depth)
+		return -EBUSY;
+	chan->queue[(chan->q_first + chan->q_len++) % ZIO_QUEUE_MAX] = block;
+	return 0;
+}
+
+static inline struct zio_block *zio_chan_dequeue(struct zio_channel *chan)
+{
+	struct zio_block *block;
+
+	if (!chan->q_len)
+		return NULL;
+	block = chan->queue[chan->q_first];
+	chan->q_first = (chan->q_first + 1) % ZIO_QUEUE_MAX;
+	chan->q_len--;
+	return block;
+}
+
 /*
  * This generic_data_done can be used by triggers, as part of their own.
  * If no trigger-specific function is specified, the core calls this one.
@@ -153,6 +194,8 @@ static inline int zio_trigger_abort_disable(struct zio_cset *cset, int disable)
 static inline int zio_generic_data_done(struct zio_cset *cset)
 {
 	int self_timed = cset->flags & ZIO_CSET_SELF_TIMED;
+	int defer = (cset->flags & ZIO_CSET_DEFER_DONE) &&
+		    (cset->flags & ZIO_DIR) == ZIO_DIR_INPUT;
 	struct zio_buffer_type *zbuf;
 	struct zio_channel *chan;
 	struct zio_block *block;
@@ -171,8 +214,8 @@ static inline int zio_generic_data_done(struct zio_cset *cset)
 		block = chan->active_block;
 		ctrl = chan->current_ctrl;
 
-		/* Remove the block from active block */
-		chan->active_block = NULL;
+		/* Remove the block from active block: the next one follows */
+		chan->active_block = zio_chan_dequeue(chan);
 
 		/* Update the current control: sequence and timestamp */
 		ctrl->seq_num++;
@@ -187,18 +230,31 @@ static inline int zio_generic_data_done(struct zio_cset *cset)
 
 		if (unlikely((ti->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)) {
 			zio_buffer_free_block(chan->bi, block);
+		} else if (defer) {
+			zio_defer_block(chan, block);
 		} else { /* DIR_INPUT */
 			memcpy(zio_get_ctrl(block), ctrl,
 			       zio_control_size(chan));
 			zio_buffer_store_block(bi, block);
 		}
 	}
+	if (defer) {
+		/* The work stores the blocks, and re-arms if needed */
+		zio_defer_done(cset, self_timed);
+		return 0;
+	}
 	if (likely((ti->flags & ZIO_DIR) == ZIO_DIR_INPUT))
 		return (self_timed ? 1 : 0);
 
-	/* Only for output: prepare the next event if any is ready */
-	chan_for_each(chan, cset)
-		chan->active_block = zio_buffer_retr_block(chan->bi);
+	/* Only for output: prepare the next events if any is ready */
+	chan_for_each(chan, cset) {
+		if (!chan->active_block)
+			chan->active_block = zio_buffer_retr_block(chan->bi);
+		while (chan->active_block &&
+		       chan->q_len + 1 < cset->queue_depth &&
+		       (block = zio_buffer_retr_block(chan->bi)))
+			zio_chan_enqueue(chan, block);
+	}
 
 	return (self_timed ? 1 : 0);
 }
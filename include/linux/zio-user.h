@@ -151,6 +151,12 @@ struct zio_tlv {
 	uint8_t payload[8];
 };
 
+/* Globally assigned TLV types */
+#define ZIO_TLV_END		0	/* 16 zero bytes, ends the chain */
+#define ZIO_TLV_READ_MORE	1	/* payload: bytes of TLV after this */
+#define ZIO_TLV_ATTR_CHAN	2	/* payload: attributes of the channel */
+#define ZIO_TLV_ATTR_TRIG	3	/* payload: attributes of the trigger */
+
 /*
  * We have at most 8 zio alarms and at most 8 driver alarm. The former
  * group is defined here, the latter group is driver-specific.
@@ -205,6 +211,26 @@ struct zio_control {
 	/* byte 512: we are done */
 };
 
+/*
+ * Input channels may return compact controls instead (see the
+ * "control-format" attribute of the channel): the first 96 bytes of
+ * zio_control, with ZIO_CONTROL_COMPACT in flags, followed by the
+ * selected TLV records and the terminator. The record for a set of
+ * attributes is 13 lumps long.
+ */
+#define __ZIO_CONTROL_HEAD_SIZE	96
+
+#define ZIO_CTRL_FMT_COMPACT	0x01	/* head and terminator */
+#define ZIO_CTRL_FMT_ATTR_CHAN	0x02	/* ... and ZIO_TLV_ATTR_CHAN */
+#define ZIO_CTRL_FMT_ATTR_TRIG	0x04	/* ... and ZIO_TLV_ATTR_TRIG */
+#define ZIO_CTRL_FMT_MASK	0x07
+
+struct zio_tlv_attr {
+	uint32_t type;
+	uint32_t length;	/* 13 */
+	struct zio_ctrl_attr attr;
+};
+
 /* The following flags are used in the control structure */
 #define ZIO_CONTROL_LITTLE_ENDIAN	0x01000001
 #define ZIO_CONTROL_BIG_ENDIAN		0x02000002
@@ -213,6 +239,46 @@ struct zio_control {
 #define ZIO_CONTROL_LSB_ALIGN		0x00000008 /* for analog data */
 
 #define ZIO_CONTROL_INTERLEAVE_DATA	0x00000040 /* for interleaved data */
+#define ZIO_CONTROL_COMPACT		0x00000080 /* head and TLV only */
+
+/*
+ * Buffers exporting a ring to user space (e.g. "ring") place this header
+ * at offset 0 of the mmap area. The kernel writes head, the consumer
+ * writes tail; both are free-running counters and the slot is the counter
+ * modulo nslots (a power of two). The two indexes live in different
+ * cache lines, so producer and consumer don't bounce them.
+ */
+struct zio_ring_header {
+	/* byte 0 */
+	uint32_t nslots;	/* number of slots (controls) in the ring */
+	uint32_t slot_size;	/* data bytes for each slot, if any */
+	uint32_t ctrl_offset;	/* offset of the control array in the map */
+	uint32_t data_offset;	/* offset of the data area in the map */
+	uint32_t filler[12];
+
+	/* byte 64 */
+	uint32_t head;		/* producer index, written by the kernel */
+	uint32_t filler_head[15];
+
+	/* byte 128 */
+	uint32_t tail;		/* consumer index, written by the reader */
+	uint32_t filler_tail[15];
+	/* byte 192: we are done */
+};
+
+/*
+ * The "-all" device of an input cset returns whole trigger events. Each
+ * event is this header, followed by nchan controls, each followed by
+ * its data (nsamples * ssize, padded to 8 bytes). The channel is in the
+ * address of the control; size includes the header itself.
+ */
+struct zio_gather_header {
+	uint32_t seq_num;	/* the same as in the controls that follow */
+	uint16_t nchan;		/* number of channels in this event */
+	uint16_t flags;		/* reserved, currently 0 */
+	uint32_t size;		/* bytes in this event */
+	uint32_t reserved;
+};
 
 #ifdef __KERNEL__
 /*
@@ -223,6 +289,9 @@ struct zio_control {
 static inline void __unused_check_size(void)
 {
 	BUILD_BUG_ON(sizeof(struct zio_control) != __ZIO_CONTROL_SIZE);
+	BUILD_BUG_ON(offsetof(struct zio_control, attr_channel) !=
+		     __ZIO_CONTROL_HEAD_SIZE);
+	BUILD_BUG_ON(sizeof(struct zio_tlv_attr) != 13 * sizeof(struct zio_tlv));
 }
 
 #endif /* __KERNEL__ */
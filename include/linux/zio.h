@@ -23,6 +23,7 @@ extern const uint32_t zio_version;
 #include <linux/list.h>
 #include <linux/string.h>
 #include <linux/spinlock.h>
+#include <linux/workqueue.h>
 
 #include <linux/zio-sysfs.h>
 
@@ -183,6 +184,12 @@ struct zio_cset {
 
 	struct list_head	list_cset;	/* for cset global list */
 	int			minor, maxminor;
+	int			xminor;		/* extra: combined, gather */
+	struct device		*gather_dev;	/* "-all" cdev, input only */
+	wait_queue_head_t	gather_q;	/* for its readers */
+	unsigned int		done_gen;	/* events stored, cset lock */
+	unsigned int		queue_depth;	/* active blocks per channel */
+	struct work_struct	done_work;	/* for ZIO_CSET_DEFER_DONE */
 	char			*default_zbuf;
 	char			*default_trig;
 
@@ -201,6 +208,8 @@ enum zio_cset_flags {
 	ZIO_CSET_CHAN_INTERLEAVE= 0x200, /* 1 if cset can interleave */
 	ZIO_CSET_INTERLEAVE_ONLY= 0x400, /* 1 if interleave only */
 	ZIO_CSET_HW_BUSY	= 0x800, /* set by driver, delays abort */
+	ZIO_CSET_DEFER_DONE	= 0x1000, /* input data_done ends in a work */
+	ZIO_CSET_DONE_REARM	= 0x2000, /* the work must re-arm */
 };
 
 /* Check the flags so we know whether to arm immediately or not */
@@ -218,6 +227,12 @@ static inline int zio_cset_early_arm(struct zio_cset *cset)
 /*
  * zio_channel -- an individual channel within the cset
  */
+struct zio_splice_block;
+
+/* Maximum queue-depth: blocks given to hardware at the same time */
+#define ZIO_QUEUE_MAX 8
+/* Completed blocks waiting for the deferred data_done, per channel */
+#define ZIO_DONE_MAX 16
 
 struct zio_channel {
 	struct zio_obj_head	head;
@@ -230,14 +245,32 @@ struct zio_channel {
 
 	struct device		*ctrl_dev;	/* control char device */
 	struct device		*data_dev;	/* data char device */
+	struct device		*comb_dev;	/* combined char device */
 
 	void			*priv_d;	/* private for the device */
 	void			*priv_t;	/* private for the trigger */
 
 	struct zio_control	*current_ctrl;	/* the active one */
+	unsigned int		ctrl_fmt;	/* ZIO_CTRL_FMT_* for readers */
 	struct zio_block	*user_block;	/* being transferred w/ user */
+	struct zio_splice_block	*user_sblock;	/* user_block is in a pipe */
+	atomic_t		n_spliced;	/* blocks in pipes, they use bi */
 	struct mutex		user_lock;
+	/* shared-read: every consumer sees every block (user_lock) */
+	struct list_head	consumers;
+	struct list_head	shared_blocks;	/* oldest first */
+	uint32_t		shared_seq;	/* of the next shared block */
+	int			n_consumers;
+	/* stream-read: controls of blocks consumed by data reads */
+	struct zio_control	*stream_ctrl;
+	unsigned int		stream_head, stream_tail;
 	struct zio_block	*active_block;	/* being managed by hardware */
+	/* the following ones, with queue-depth > 1 (cset lock) */
+	struct zio_block	*queue[ZIO_QUEUE_MAX];
+	unsigned int		q_first, q_len;
+	/* completed ones, with ZIO_CSET_DEFER_DONE (cset lock) */
+	struct zio_block	*done[ZIO_DONE_MAX];
+	unsigned int		d_first, d_len;
 
 	void			(*change_flags)(struct zio_obj_head *head,
 						unsigned long mask);
@@ -248,6 +281,8 @@ enum zio_chan_flags {
 	ZIO_CHAN_POLAR		= 0x10,	/* 0 is positive - 1 is negative*/
 	ZIO_CHAN_POLAR_POSITIVE	= 0x00,
 	ZIO_CHAN_POLAR_NEGATIVE	= 0x10,
+	ZIO_CHAN_SHARED_READ	= 0x20,	/* 1 if each reader sees all blocks */
+	ZIO_CHAN_STREAM_READ	= 0x40,	/* 1 if data reads span blocks */
 };
 
 /* get each channel from cset */
@@ -356,18 +391,35 @@ static inline int zio_cset_is_busy(struct zio_cset *cset)
 #define zio_set_cdone(block)  ((block)->ctrl_flags |= 1)
 
 /*
- * It returns the size of the control associated to a channel.
- * When TLV is implemented, the value will be channel-dependent.
+ * It returns the size of the control as users of the channel see it:
+ * the whole structure or the compact one. Blocks always carry a whole
+ * control, of __ZIO_CONTROL_SIZE bytes.
  */
+static inline unsigned int __zio_control_size(unsigned int fmt)
+{
+	unsigned int size = __ZIO_CONTROL_HEAD_SIZE + sizeof(struct zio_tlv);
+
+	if (!fmt)
+		return __ZIO_CONTROL_SIZE;
+	if (fmt & ZIO_CTRL_FMT_ATTR_CHAN)
+		size += sizeof(struct zio_tlv_attr);
+	if (fmt & ZIO_CTRL_FMT_ATTR_TRIG)
+		size += sizeof(struct zio_tlv_attr);
+	return size;
+}
+
 static inline unsigned int zio_control_size(struct zio_channel *chan)
 {
-	return __ZIO_CONTROL_SIZE;
+	if (!chan)
+		return __ZIO_CONTROL_SIZE;
+	return __zio_control_size(READ_ONCE(chan->ctrl_fmt));
 }
 
 /* We have an optional misc device that returns all control blocks */
 int zio_sniffdev_init(void);
 void zio_sniffdev_exit(void);
 void zio_sniffdev_add(struct zio_control *ctrl);
+int zio_sniffdev_active(void);
 
 /*
  * Misc library-like code, from zio-misc.c
@@ -382,5 +434,20 @@ void zio_ffa_free_s(struct zio_ffa *ffa, unsigned long addr, size_t size);
 void zio_ffa_dump(struct zio_ffa *ffa); /* diagnostics */
 void zio_ffa_reset(struct zio_ffa *ffa);
 
+/* circular bump allocator, for users that free in allocation order */
+struct zio_cba_stats {
+	unsigned long wraps;		/* times the head went back to begin */
+	unsigned long waste;		/* bytes currently skipped at the end */
+	unsigned long unordered;	/* frees not in allocation order */
+	unsigned long nospace;		/* failed allocations */
+};
+struct zio_cba *zio_cba_create(unsigned long begin, unsigned long end,
+			       unsigned int nrec);
+void zio_cba_destroy(struct zio_cba *cba);
+#define ZIO_CBA_NOSPACE ZIO_FFA_NOSPACE
+unsigned long zio_cba_alloc(struct zio_cba *cba, size_t size);
+void zio_cba_free_s(struct zio_cba *cba, unsigned long addr, size_t size);
+void zio_cba_stats(struct zio_cba *cba, struct zio_cba_stats *stats);
+
 #endif /* __KERNEL__ */
 #endif /* __ZIO_H__ */
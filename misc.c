@@ -13,6 +13,7 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
 #include <linux/list.h>
 #include <linux/zio.h>
 
@@ -181,6 +182,10 @@ found:
 	}
 	/* split the cell: "new" is the busy head, ffa still points to c */
 	new = kzalloc(sizeof(*new), gfp);
+	if (!new) {
+		spin_unlock_irqrestore(&ffa->lock, flags);
+		return ZIO_FFA_NOSPACE;
+	}
 	new->begin = c->begin;
 	new->end = new->begin + size;
 	c->begin = new->end;
@@ -208,18 +213,29 @@ void zio_ffa_free_s(struct zio_ffa *ffa, unsigned long addr, size_t size)
 			break;
 	BUG_ON(!c);
 	BUG_ON(c->status == FFA_FREE);
-	if (c->begin != addr) {
-		/* add a busy cell before us */
+	/* allocate the split cells first: if we can't, leak the space */
+	if (c->begin != addr)
 		prev = kzalloc(sizeof(*prev), GFP_ATOMIC);
+	if (c->end != addr + size)
+		next = kzalloc(sizeof(*next), GFP_ATOMIC);
+	if ((c->begin != addr && !prev) || (c->end != addr + size && !next)) {
+		spin_unlock_irqrestore(&ffa->lock, flags);
+		pr_warn_ratelimited("%s: no memory, lost 0x%lx-0x%lx\n",
+				    __func__, addr, end);
+		kfree(prev);
+		kfree(next);
+		return;
+	}
+	if (prev) {
+		/* add a busy cell before us */
 		prev->begin = c->begin;
 		prev->end = addr;
 		prev->status = c->status;
 		c->begin = addr;
 		list_add_tail(&prev->list, &c->list);
 	}
-	if (c->end != addr + size) {
+	if (next) {
 		/* add a busy cell after us */
-		next = kzalloc(sizeof(*next), GFP_ATOMIC);
 		next->begin = end;
 		next->end = c->end;
 		next->status = c->status;
@@ -259,3 +275,177 @@ void zio_ffa_reset(struct zio_ffa *ffa)
 	spin_unlock_irqrestore(&ffa->lock, flags);
 }
 EXPORT_SYMBOL(zio_ffa_reset);
+
+
+/*
+ * Circular bump allocator. It is meant for FIFO users, like buffers, that
+ * almost always free in allocation order: allocation bumps the head and
+ * freeing the oldest block moves the tail, both O(1). When the space at
+ * the end of the area is too small, it is skipped ("wasted") and we wrap.
+ *
+ * Each allocation is recorded in a fixed-size ring of records, allocated
+ * at create time, so nothing is allocated afterwards. A block freed out of
+ * order is looked up from the oldest record and only marked as free: the
+ * tail moves over it when the blocks before it are freed as well.
+ * A free may cover several adjacent allocations (e.g. merged blocks).
+ */
+enum CBA_STATUS {
+	CBA_FREE = 0,
+	CBA_BUSY,
+	CBA_PAD, /* space skipped at wrap time */
+};
+
+struct cba_rec {
+	unsigned long begin;
+	unsigned long end; /* first invalid value */
+	int status;
+};
+
+struct zio_cba {
+	spinlock_t lock;
+	unsigned long begin, end;	/* the area */
+	unsigned long head, tail;	/* next allocation, oldest busy */
+	unsigned long used;		/* busy and wasted bytes */
+	unsigned int nrec, first, count; /* record ring */
+	struct zio_cba_stats stats;
+	struct cba_rec rec[];
+};
+
+#define cba_rec(cba, i) (&(cba)->rec[((cba)->first + (i)) % (cba)->nrec])
+
+/* The create and destroy must be called in non-atomic context and don't lock */
+struct zio_cba *zio_cba_create(unsigned long begin, unsigned long end,
+			       unsigned int nrec)
+{
+	struct zio_cba *cba;
+
+	if (!nrec)
+		return NULL;
+	cba = vzalloc(sizeof(*cba) + nrec * sizeof(struct cba_rec));
+	if (!cba)
+		return NULL;
+	spin_lock_init(&cba->lock);
+	cba->begin = cba->head = cba->tail = begin;
+	cba->end = end;
+	cba->nrec = nrec;
+	return cba;
+}
+EXPORT_SYMBOL(zio_cba_create);
+
+void zio_cba_destroy(struct zio_cba *cba)
+{
+	vfree(cba);
+}
+EXPORT_SYMBOL(zio_cba_destroy);
+
+/* Called in locked context, when there is a free record */
+static void cba_push(struct zio_cba *cba, unsigned long size, int status)
+{
+	struct cba_rec *r = cba_rec(cba, cba->count);
+
+	r->begin = cba->head;
+	r->end = cba->head + size;
+	r->status = status;
+	cba->count++;
+	cba->used += size;
+	cba->head += size;
+}
+
+/* alloc can be called from atomic context, but it never allocates */
+unsigned long zio_cba_alloc(struct zio_cba *cba, size_t size)
+{
+	unsigned long flags, ret = ZIO_CBA_NOSPACE;
+	unsigned long pad;
+
+	spin_lock_irqsave(&cba->lock, flags);
+	if (!size) { /* nothing to record, and nothing to free later */
+		ret = cba->head;
+		goto out;
+	}
+	if (!cba->count) /* empty: restart from the beginning */
+		cba->head = cba->tail = cba->begin;
+
+	if (cba->count == cba->nrec)
+		goto out;
+	if (cba->head < cba->tail || (cba->used && cba->head == cba->tail)) {
+		/* wrapped: the free space is between head and tail */
+		if (cba->tail - cba->head < size)
+			goto out;
+	} else if (cba->end - cba->head < size) {
+		/* no room at the end: skip it, if there's room at begin */
+		pad = cba->end - cba->head;
+		if (cba->tail - cba->begin < size ||
+		    cba->count + 2 > cba->nrec)
+			goto out;
+		cba_push(cba, pad, CBA_PAD);
+		cba->stats.waste += pad;
+		cba->stats.wraps++;
+		cba->head = cba->begin;
+	}
+	ret = cba->head;
+	cba_push(cba, size, CBA_BUSY);
+	if (cba->head == cba->end) {
+		cba->stats.wraps++;
+		cba->head = cba->begin;
+	}
+out:
+	if (ret == ZIO_CBA_NOSPACE)
+		cba->stats.nospace++;
+	spin_unlock_irqrestore(&cba->lock, flags);
+	return ret;
+}
+EXPORT_SYMBOL(zio_cba_alloc);
+
+/* free can be called from atomic context */
+void zio_cba_free_s(struct zio_cba *cba, unsigned long addr, size_t size)
+{
+	struct cba_rec *r;
+	unsigned long flags, end = addr + size;
+	unsigned int i;
+
+	if (!size)
+		return;
+	spin_lock_irqsave(&cba->lock, flags);
+	for (i = 0; i < cba->count; i++) {
+		r = cba_rec(cba, i);
+		if (r->status == CBA_BUSY && r->begin == addr)
+			break;
+	}
+	BUG_ON(i == cba->count);
+	if (i)
+		cba->stats.unordered++;
+	/* mark this one and those merged to it, that follow contiguously */
+	r->status = CBA_FREE;
+	for (i++; i < cba->count && r->end < end; i++) {
+		if (cba_rec(cba, i)->begin != r->end)
+			break;
+		r = cba_rec(cba, i);
+		r->status = CBA_FREE;
+	}
+
+	/* move the tail over all the free records at the beginning */
+	while (cba->count) {
+		r = cba_rec(cba, 0);
+		if (r->status == CBA_BUSY)
+			break;
+		if (r->status == CBA_PAD)
+			cba->stats.waste -= r->end - r->begin;
+		cba->used -= r->end - r->begin;
+		cba->tail = r->end == cba->end ? cba->begin : r->end;
+		cba->first = (cba->first + 1) % cba->nrec;
+		cba->count--;
+	}
+	spin_unlock_irqrestore(&cba->lock, flags);
+}
+EXPORT_SYMBOL(zio_cba_free_s);
+
+/* Statistics are a snapshot, taken in locked context */
+void zio_cba_stats(struct zio_cba *cba, struct zio_cba_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&cba->lock, flags);
+	*stats = cba->stats;
+	spin_unlock_irqrestore(&cba->lock, flags);
+}
+EXPORT_SYMBOL(zio_cba_stats);
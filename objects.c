@@ -97,6 +97,8 @@ static void __bi_release(struct device *dev)
 
 	/* Remove zio attribute */
 	zio_destroy_attributes(&bi->head);
+	hrtimer_cancel(&bi->wake_timer);
+	zio_bi_set_eventfd(bi, -1);
 	/* Destroy buffer instance. It frees buffer resources */
 	bi->b_op->destroy(bi);
 
@@ -230,9 +232,9 @@ static struct zio_bi *__bi_create(struct zio_buffer_type *zbuf,
 	pr_debug("%s\n", __func__);
 
 	/* Create buffer, ensuring it's not reentrant */
-	spin_lock(&zbuf->lock);
+	mutex_lock(&zbuf->lock);
 	bi = zbuf->b_op->create(zbuf, chan);
-	spin_unlock(&zbuf->lock);
+	mutex_unlock(&zbuf->lock);
 	if (IS_ERR(bi)) {
 		err = PTR_ERR(bi);
 		pr_err("ZIO %s: can't create buffer, error %d\n",
@@ -245,11 +247,15 @@ static struct zio_bi *__bi_create(struct zio_buffer_type *zbuf,
 	dev_set_name(&bi->head.dev, name);
 	spin_lock_init(&bi->lock);
 	atomic_set(&bi->use_count, 0);
+	atomic_set(&bi->nready, 0);
 	bi->b_op = zbuf->b_op;
 	bi->f_op = zbuf->f_op;
 	bi->v_op = zbuf->v_op;
 	bi->flags |= (chan->flags & ZIO_DIR);
+	bi->node = zio_chan_to_node(chan);
 	init_waitqueue_head(&bi->q);
+	hrtimer_init(&bi->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	bi->wake_timer.function = zio_bi_wake_timer;
 
 	/* Initialize head */
 	bi->head.dev.type = &bi_device_type;
@@ -271,9 +277,9 @@ static struct zio_bi *__bi_create(struct zio_buffer_type *zbuf,
 		goto out_remove;
 
 	/* Add to buffer instance list */
-	spin_lock(&zbuf->lock);
+	mutex_lock(&zbuf->lock);
 	list_add(&bi->list, &zbuf->list);
-	spin_unlock(&zbuf->lock);
+	mutex_unlock(&zbuf->lock);
 
 	bi->cset = chan->cset;
 	bi->chan = chan;
@@ -299,9 +305,9 @@ static void __bi_destroy(struct zio_buffer_type *zbuf, struct zio_bi *bi)
 	dev_dbg(&bi->head.dev, "destroying buffer instance\n");
 
 	/* Remove from buffer instance list */
-	spin_lock(&zbuf->lock);
+	mutex_lock(&zbuf->lock);
 	list_del(&bi->list);
-	spin_unlock(&zbuf->lock);
+	mutex_unlock(&zbuf->lock);
 	device_unregister(&bi->head.dev);
 }
 
@@ -432,6 +438,8 @@ int zio_change_current_trigger(struct zio_cset *cset, char *name)
 
 	/* Ok, we are done. Kill the current trigger to replace it*/
 	zio_trigger_abort_disable(cset, 1);
+	/* A pending deferred data_done may re-arm the old instance */
+	flush_work(&cset->done_work);
 	__ti_destroy(trig_old, ti_old);
 	zio_trigger_put(trig_old, cset->zdev->owner);
 
@@ -490,6 +498,11 @@ int zio_change_current_buffer(struct zio_cset *cset, char *name)
 	zbuf = zio_buffer_get(cset, name);
 	if (IS_ERR(zbuf))
 		return PTR_ERR(zbuf);
+	/* A buffer that allocates one block at a time can't fill a queue */
+	if ((zbuf->flags & ZIO_BUF_FLAG_SINGLE) && cset->queue_depth > 1) {
+		err = -EINVAL;
+		goto out_put;
+	}
 
 	bi_vector = kzalloc(sizeof(struct zio_bi *) * cset->n_chan,
 			     GFP_KERNEL);
@@ -526,8 +539,13 @@ int zio_change_current_buffer(struct zio_cset *cset, char *name)
 		}
 	}
 	tflags = zio_trigger_abort_disable(cset, 1);
+	/* Deferred blocks go to the old instances, before they are gone */
+	flush_work(&cset->done_work);
 
 	for (i = 0; i < cset->n_chan; ++i) {
+		/* The eventfd binding survives the change (trigger is off) */
+		bi_vector[i]->efd = cset->chan[i].bi->efd;
+		cset->chan[i].bi->efd = NULL;
 		/* Delete old buffer instance */
 		__bi_destroy(zbuf_old, cset->chan[i].bi);
 		/* Assign new buffer instance */
@@ -916,6 +934,9 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 	snprintf(cset_name, ZIO_NAME_LEN, "cset%i", cset->index);
 	dev_set_name(&cset->head.dev, cset_name);
 	spin_lock_init(&cset->lock);
+	init_waitqueue_head(&cset->gather_q);
+	cset->queue_depth = 1;
+	INIT_WORK(&cset->done_work, zio_done_work);
 	cset->head.dev.type = &cset_device_type;
 	cset->head.dev.parent = &cset->zdev->head.dev;
 	err = device_register(&cset->head.dev);
@@ -963,6 +984,8 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 		cset->chan[i].cset = cset;
 		cset->chan[i].ti = cset->ti;
 		mutex_init(&cset->chan[i].user_lock);
+		INIT_LIST_HEAD(&cset->chan[i].consumers);
+		INIT_LIST_HEAD(&cset->chan[i].shared_blocks);
 		cset->chan[i].flags |= cset->flags & ZIO_DIR;
 
 		chan_tmp = chan_get_template(cset_t, i);
@@ -974,6 +997,9 @@ static int cset_register(struct zio_cset *cset, struct zio_cset *cset_t)
 		if (cset->flags & ZIO_CSET_INTERLEAVE_ONLY)
 			cset->chan[i].flags |= ZIO_DISABLED;
 	}
+	err = zio_create_cset_device(cset);
+	if (err)
+		goto out_reg;
 
 	spin_lock(&zstat->lock);
 	list_add(&cset->list_cset, &zstat->list_cset);
@@ -1021,6 +1047,8 @@ static void cset_unregister(struct zio_cset *cset)
 	spin_unlock(&zstat->lock);
 	/* Make it idle */
 	zio_trigger_abort_disable(cset, 1);
+	flush_work(&cset->done_work);
+	zio_destroy_cset_device(cset);
 	/* Unregister all child channels */
 	for (i = 0; i < cset->n_chan; i++)
 		chan_unregister(&cset->chan[i]);
@@ -1345,7 +1373,7 @@ int zio_register_buf(struct zio_buffer_type *zbuf, const char *name)
 	if (zbuf->zattr_set.std_zattr)
 		zbuf->zattr_set.n_std_attr = _ZIO_BUF_ATTR_STD_NUM;
 	INIT_LIST_HEAD(&zbuf->list);
-	spin_lock_init(&zbuf->lock);
+	mutex_init(&zbuf->lock);
 
 	return 0;
 }
@@ -44,6 +44,12 @@ struct zio_sniffdev_ctrl {
 	int size;
 };
 
+/* Checked on the free path, so controls are only copied when needed */
+int zio_sniffdev_active(void)
+{
+	return !list_empty(&zio_sniffdev_files);
+}
+
 /* Add a new control to all files. Can be called in atomic context */
 void zio_sniffdev_add(struct zio_control *ctrl)
 {
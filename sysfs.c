@@ -859,6 +859,169 @@ static ssize_t zio_show_pref(struct device *dev,
 }
 
 
+/**
+ * It configures the NUMA node where the buffer allocates its memory,
+ * -1 for no preference. It applies to the following allocations.
+ */
+static ssize_t zio_store_node(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	unsigned long flags;
+	int err, node;
+
+	err = kstrtoint(buf, 0, &node);
+	if (err)
+		return err;
+	if (node != NUMA_NO_NODE &&
+	    (node < 0 || node >= nr_node_ids || !node_online(node)))
+		return -EINVAL;
+
+	spin_lock_irqsave(&bi->lock, flags);
+	bi->node = node;
+	spin_unlock_irqrestore(&bi->lock, flags);
+
+	return count;
+}
+static ssize_t zio_show_node(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+
+	return sprintf(buf, "%d\n", bi->node);
+}
+
+/**
+ * Reader wake-up thresholds: blocks, bytes and the latency bound (usecs).
+ * The attribute name selects the field; 0 means "not used" for the
+ * thresholds, and ZIO_WAKE_USECS_DEFAULT for the latency bound.
+ */
+static unsigned int *zio_bi_wake_field(struct zio_bi *bi,
+				       struct device_attribute *attr)
+{
+	if (!strcmp(attr->attr.name, "wake-blocks"))
+		return &bi->wake_blocks;
+	if (!strcmp(attr->attr.name, "wake-bytes"))
+		return &bi->wake_bytes;
+	return &bi->wake_usecs;
+}
+static ssize_t zio_store_wake(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	WRITE_ONCE(*zio_bi_wake_field(bi, attr), val);
+
+	return count;
+}
+static ssize_t zio_show_wake(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_bi *bi = to_zio_bi(dev);
+
+	return sprintf(buf, "%u\n", *zio_bi_wake_field(bi, attr));
+}
+
+/**
+ * It configures how many blocks of each channel can be given to the
+ * hardware at the same time (1 to ZIO_QUEUE_MAX). Blocks already queued
+ * are not affected by a smaller value. Buffers that allocate one block
+ * at a time can't queue, so they only accept 1.
+ */
+static ssize_t zio_store_qdep(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_cset *cset = to_zio_cset(dev);
+	unsigned long flags;
+	unsigned int val;
+	int err;
+
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	if (val < 1 || val > ZIO_QUEUE_MAX)
+		return -EINVAL;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	if (val > 1 && (cset->zbuf->flags & ZIO_BUF_FLAG_SINGLE))
+		err = -EINVAL;
+	else
+		cset->queue_depth = val;
+	spin_unlock_irqrestore(&cset->lock, flags);
+
+	return err ? err : count;
+}
+static ssize_t zio_show_qdep(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_cset *cset = to_zio_cset(dev);
+
+	return sprintf(buf, "%u\n", cset->queue_depth);
+}
+
+/**
+ * It configures deferred data_done for input csets: the blocks completed
+ * by the driver are stored by a work, so interrupt handlers are shorter.
+ */
+static ssize_t zio_store_defe(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_cset *cset = to_zio_cset(dev);
+	unsigned long flags;
+
+	if ((cset->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return -EINVAL;
+
+	spin_lock_irqsave(&cset->lock, flags);
+	if (buf[0] == '0')
+		cset->flags &= ~ZIO_CSET_DEFER_DONE;
+	else
+		cset->flags |= ZIO_CSET_DEFER_DONE;
+	spin_unlock_irqrestore(&cset->lock, flags);
+	/* Blocks already parked are stored before we return */
+	flush_work(&cset->done_work);
+
+	return count;
+}
+static ssize_t zio_show_defe(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_cset *cset = to_zio_cset(dev);
+
+	return sprintf(buf, "%d\n", !!(cset->flags & ZIO_CSET_DEFER_DONE));
+}
+
+/**
+ * It binds an eventfd of the writing process to the buffer instance,
+ * or to all the buffer instances of a channel set; -1 unbinds.
+ * The eventfd counts the blocks stored for reading.
+ */
+static ssize_t zio_store_efd(struct device *dev,
+			     struct device_attribute *attr,
+			     const char *buf, size_t count)
+{
+	struct zio_obj_head *head = to_zio_head(dev);
+	int err, fd;
+
+	err = kstrtoint(buf, 0, &fd);
+	if (err)
+		return err;
+	if (head->zobj_type == ZIO_BI)
+		err = zio_bi_set_eventfd(to_zio_bi(dev), fd);
+	else
+		err = zio_cset_set_eventfd(to_zio_cset(dev), fd);
+	return err ? err : count;
+}
+
 static ssize_t zio_show_inte(struct device *dev,
 			     struct device_attribute *attr, char *buf)
 {
@@ -867,6 +1030,99 @@ static ssize_t zio_show_inte(struct device *dev,
 	return sprintf(buf, "%d\n", !!(chan->flags & ZIO_CSET_CHAN_INTERLEAVE));
 }
 
+/**
+ * It configures shared read: when set, each process reading the channel
+ * sees all blocks. It applies to files opened later, and it can't change
+ * while blocks are being read.
+ */
+static ssize_t zio_store_shar(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_channel *chan = to_zio_chan(dev);
+	unsigned long flags;
+	int err = 0;
+
+	mutex_lock(&chan->user_lock);
+	if (chan->user_block || chan->n_consumers) {
+		err = -EBUSY;
+	} else {
+		spin_lock_irqsave(&chan->cset->lock, flags);
+		if (buf[0] == '0')
+			chan->flags &= ~ZIO_CHAN_SHARED_READ;
+		else
+			chan->flags |= ZIO_CHAN_SHARED_READ;
+		spin_unlock_irqrestore(&chan->cset->lock, flags);
+	}
+	mutex_unlock(&chan->user_lock);
+
+	return err ? err : count;
+}
+static ssize_t zio_show_shar(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_channel *chan = to_zio_chan(dev);
+
+	return sprintf(buf, "%d\n", !!(chan->flags & ZIO_CHAN_SHARED_READ));
+}
+
+/**
+ * It configures stream read for input channels: a data read goes on with
+ * the following blocks, and their controls can be read later in bulk.
+ */
+static ssize_t zio_store_stre(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_channel *chan = to_zio_chan(dev);
+	int err;
+
+	if ((chan->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return -EINVAL;
+	err = zio_chan_stream_set(chan, buf[0] != '0');
+
+	return err ? err : count;
+}
+static ssize_t zio_show_stre(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_channel *chan = to_zio_chan(dev);
+
+	return sprintf(buf, "%d\n", !!(chan->flags & ZIO_CHAN_STREAM_READ));
+}
+
+/**
+ * It selects the control format returned to readers of input channels:
+ * 0 is the whole control, otherwise ZIO_CTRL_FMT_* (compact).
+ */
+static ssize_t zio_store_cfmt(struct device *dev,
+			      struct device_attribute *attr,
+			      const char *buf, size_t count)
+{
+	struct zio_channel *chan = to_zio_chan(dev);
+	unsigned int val;
+	int err;
+
+	if ((chan->flags & ZIO_DIR) == ZIO_DIR_OUTPUT)
+		return -EINVAL;
+	err = kstrtouint(buf, 0, &val);
+	if (err)
+		return err;
+	if ((val & ~ZIO_CTRL_FMT_MASK) ||
+	    (val && !(val & ZIO_CTRL_FMT_COMPACT)))
+		return -EINVAL;
+	WRITE_ONCE(chan->ctrl_fmt, val);
+
+	return count;
+}
+static ssize_t zio_show_cfmt(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	struct zio_channel *chan = to_zio_chan(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(chan->ctrl_fmt));
+}
+
 #if ZIO_HAS_BINARY_CONTROL
 /*
  * zobj_read_cur_ctrl
@@ -947,6 +1203,16 @@ enum zio_default_attribute_numeration {
 	ZIO_DAN_DIRE,   /* direction */
 	ZIO_DAN_PREF,	/* prefer-new */
 	ZIO_DAN_INTE,	/* interleave */
+	ZIO_DAN_NODE,	/* numa-node */
+	ZIO_DAN_WBLK,	/* wake-blocks */
+	ZIO_DAN_WBYT,	/* wake-bytes */
+	ZIO_DAN_WUSE,	/* wake-usecs */
+	ZIO_DAN_SHAR,	/* shared-read */
+	ZIO_DAN_STRE,	/* stream-read */
+	ZIO_DAN_EFD,	/* eventfd */
+	ZIO_DAN_QDEP,	/* queue-depth */
+	ZIO_DAN_DEFE,	/* deferred-done */
+	ZIO_DAN_CFMT,	/* control-format */
 };
 
 /* default zio attributes */
@@ -973,6 +1239,26 @@ static struct device_attribute zio_default_attributes[] = {
 				zio_show_pref, zio_store_pref),
 	[ZIO_DAN_INTE] = __ATTR(interleave, ZIO_RW_PERM,
 				zio_show_inte, NULL),
+	[ZIO_DAN_NODE] = __ATTR(numa-node, ZIO_RW_PERM,
+				zio_show_node, zio_store_node),
+	[ZIO_DAN_WBLK] = __ATTR(wake-blocks, ZIO_RW_PERM,
+				zio_show_wake, zio_store_wake),
+	[ZIO_DAN_WBYT] = __ATTR(wake-bytes, ZIO_RW_PERM,
+				zio_show_wake, zio_store_wake),
+	[ZIO_DAN_WUSE] = __ATTR(wake-usecs, ZIO_RW_PERM,
+				zio_show_wake, zio_store_wake),
+	[ZIO_DAN_SHAR] = __ATTR(shared-read, ZIO_RW_PERM,
+				zio_show_shar, zio_store_shar),
+	[ZIO_DAN_STRE] = __ATTR(stream-read, ZIO_RW_PERM,
+				zio_show_stre, zio_store_stre),
+	[ZIO_DAN_EFD] = __ATTR(eventfd, ZIO_WO_PERM,
+				NULL, zio_store_efd),
+	[ZIO_DAN_QDEP] = __ATTR(queue-depth, ZIO_RW_PERM,
+				zio_show_qdep, zio_store_qdep),
+	[ZIO_DAN_DEFE] = __ATTR(deferred-done, ZIO_RW_PERM,
+				zio_show_defe, zio_store_defe),
+	[ZIO_DAN_CFMT] = __ATTR(control-format, ZIO_RW_PERM,
+				zio_show_cfmt, zio_store_cfmt),
 	__ATTR_NULL,
 };
 /* default attributes for most of the zio objects */
@@ -992,12 +1278,18 @@ static struct attribute *def_cset_attrs_ptr[] = {
 	&zio_default_attributes[ZIO_DAN_CTRI].attr,
 	&zio_default_attributes[ZIO_DAN_CBUF].attr,
 	&zio_default_attributes[ZIO_DAN_DIRE].attr,
+	&zio_default_attributes[ZIO_DAN_EFD].attr,
+	&zio_default_attributes[ZIO_DAN_QDEP].attr,
+	&zio_default_attributes[ZIO_DAN_DEFE].attr,
 	NULL,
 };
 /* default attributes for channel */
 static struct attribute *def_chan_attrs_ptr[] = {
 	&zio_default_attributes[ZIO_DAN_ALAR].attr,
 	&zio_default_attributes[ZIO_DAN_INTE].attr,
+	&zio_default_attributes[ZIO_DAN_SHAR].attr,
+	&zio_default_attributes[ZIO_DAN_STRE].attr,
+	&zio_default_attributes[ZIO_DAN_CFMT].attr,
 	NULL,
 };
 /* default attributes for buffer instance */
@@ -1007,6 +1299,11 @@ static struct attribute *def_bi_attrs_ptr[] = {
 	&zio_default_attributes[ZIO_DAN_TYPE].attr,
 	&zio_default_attributes[ZIO_DAN_FLUS].attr,
 	&zio_default_attributes[ZIO_DAN_PREF].attr,
+	&zio_default_attributes[ZIO_DAN_NODE].attr,
+	&zio_default_attributes[ZIO_DAN_WBLK].attr,
+	&zio_default_attributes[ZIO_DAN_WBYT].attr,
+	&zio_default_attributes[ZIO_DAN_WUSE].attr,
+	&zio_default_attributes[ZIO_DAN_EFD].attr,
 	NULL,
 };
 
@@ -68,6 +68,90 @@ void print_buffer(int start, int end)
 	}
 }
 
+/* Complete a control read in pieces (e.g., from a file or a pipe) */
+static int ziodump_fill(int fd, unsigned char *raw, int i, int size)
+{
+	int j;
+
+	while (i < size) {
+		j = read(fd, raw + i, size - i);
+		if (j <= 0)
+			break;
+		i += j;
+	}
+	return i;
+}
+
+/*
+ * Controls may be compact, and their size depends on the channel. The
+ * kernel refuses (EINVAL) a read smaller than the control, and a read
+ * of the combined device must not go past it, so try the possible sizes
+ * from the smallest one: head and terminator, and one or two attribute
+ * records. Then follow the TLV chain, in case this is not a device.
+ */
+static int ziodump_read_ctrl(int fd, unsigned char *raw, int size)
+{
+	static const int sizes[] = {
+		__ZIO_CONTROL_HEAD_SIZE + sizeof(struct zio_tlv),
+		__ZIO_CONTROL_HEAD_SIZE + sizeof(struct zio_tlv)
+		+ sizeof(struct zio_tlv_attr),
+		__ZIO_CONTROL_SIZE,
+		__ZIO_CONTROL_HEAD_SIZE + sizeof(struct zio_tlv)
+		+ 2 * sizeof(struct zio_tlv_attr),
+	};
+	static int n;
+	struct zio_control *ctrl = (void *)raw;
+	struct zio_tlv *tlv;
+	int i, j;
+
+	while ((i = read(fd, raw, sizes[n])) < 0 && errno == EINVAL)
+		if (++n == sizeof(sizes) / sizeof(sizes[0]))
+			return -1;
+	if (i < __ZIO_CONTROL_HEAD_SIZE)
+		return i;
+	if (!(ctrl->flags & ZIO_CONTROL_COMPACT))
+		return ziodump_fill(fd, raw, i, __ZIO_CONTROL_SIZE);
+
+	for (j = __ZIO_CONTROL_HEAD_SIZE; j + sizeof(*tlv) <= size;
+	     j += tlv->length * sizeof(*tlv)) {
+		i = ziodump_fill(fd, raw, i, j + sizeof(*tlv));
+		if (i < j + sizeof(*tlv))
+			break;
+		tlv = (void *)(raw + j);
+		if (tlv->type == ZIO_TLV_END || !tlv->length)
+			break;
+	}
+	return i;
+}
+
+/* Expand a compact control to the whole structure; 0 if it is correct */
+static int ziodump_expand_ctrl(struct zio_control *ctrl, unsigned char *raw,
+			       int size)
+{
+	struct zio_tlv_attr *tlv;
+	int i = __ZIO_CONTROL_HEAD_SIZE;
+
+	memset(ctrl, 0, sizeof(*ctrl));
+	memcpy(ctrl, raw, i);
+	while (i + sizeof(struct zio_tlv) <= size) {
+		tlv = (void *)(raw + i);
+		if (tlv->type == ZIO_TLV_END)
+			return 0;
+		if (!tlv->length ||
+		    i + tlv->length * sizeof(struct zio_tlv) > size)
+			break;
+		/* Unknown types are skipped, as the length allows */
+		if (tlv->length * sizeof(struct zio_tlv) == sizeof(*tlv)) {
+			if (tlv->type == ZIO_TLV_ATTR_CHAN)
+				ctrl->attr_channel = tlv->attr;
+			if (tlv->type == ZIO_TLV_ATTR_TRIG)
+				ctrl->attr_trigger = tlv->attr;
+		}
+		i += tlv->length * sizeof(struct zio_tlv);
+	}
+	return -1;
+}
+
 static void ziodump_dataeof(int cfd, int dfd, int expected_size)
 {
 	struct stat stbuf;
@@ -93,9 +177,14 @@ void read_channel(int cfd, int dfd, FILE *log)
 {
 	int err = 0;
 	struct zio_control ctrl;
-	int i;
+	unsigned char raw[__ZIO_CONTROL_HEAD_SIZE + sizeof(struct zio_tlv)
+			  + 2 * sizeof(struct zio_tlv_attr)]
+		__attribute__((aligned(8)));
+	int i, compact;
 
-	i = read(cfd, &ctrl, sizeof(ctrl));
+	i = ziodump_read_ctrl(cfd, raw, sizeof(raw));
+	compact = i >= __ZIO_CONTROL_HEAD_SIZE &&
+		(((struct zio_control *)raw)->flags & ZIO_CONTROL_COMPACT);
 	switch (i) {
 	case -1:
 		fprintf(stderr, "%s: control read: %s\n",
@@ -106,12 +195,21 @@ void read_channel(int cfd, int dfd, FILE *log)
 			prgname);
 		exit(1);
 	default:
+		if (compact)
+			break; /* its size depends on the channel */
 		fprintf(stderr, "%s: ctrl read: %i bytes (expected %zi)\n",
 			prgname, i, sizeof(ctrl));
 		/* continue anyways */
 	case sizeof(ctrl):
 		break; /* ok */
 	}
+	if (compact) {
+		if (ziodump_expand_ctrl(&ctrl, raw, i))
+			fprintf(stderr, "%s: compact ctrl: bad TLV chain\n",
+				prgname);
+	} else {
+		memcpy(&ctrl, raw, sizeof(ctrl));
+	}
 
 	/* Fail badly if the version is not the right one */
 	if (ctrl.major_version != __ZIO_MAJOR_VERSION)
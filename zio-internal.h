@@ -9,6 +9,18 @@
 #define ZIO_HAS_BINARY_CONTROL 0
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+#define ZIO_HAS_ITER 1 /* read_iter and write_iter */
+#else
+#define ZIO_HAS_ITER 0
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+#define ZIO_HAS_SPLICE 1 /* zero-copy splice_read */
+#else
+#define ZIO_HAS_SPLICE 0
+#endif
+
 /* Defined in sysfs.c */
 extern const struct attribute_group *def_zdev_groups_ptr[];
 extern const struct attribute_group *def_cset_groups_ptr[];
@@ -40,6 +52,10 @@ struct zio_status {
 	struct zio_ffa		*minors;
 	struct cdev		chrdev;
 	dev_t			basedev;
+	/* Combined and gather devices live in a region of their own */
+	struct zio_ffa		*xminors;
+	struct cdev		xchrdev;
+	dev_t			xbasedev;
 	spinlock_t		lock;
 
 	/* List of cset, used to retrieve a cset from a minor base*/
@@ -60,12 +76,22 @@ extern void zio_minorbase_put(struct zio_cset *zcset);
 extern int zio_register_cdev(void);
 extern void zio_unregister_cdev(void);
 
+/* Minors of each channel: control and data, in this order */
+#define ZIO_CHAN_MINORS 2
+
 extern int zio_create_chan_devices(struct zio_channel *zchan);
 extern void zio_destroy_chan_devices(struct zio_channel *zchan);
+/* In the extra region, the combined devices are followed by gather */
+extern int zio_create_cset_device(struct zio_cset *cset);
+extern void zio_destroy_cset_device(struct zio_cset *cset);
+extern int zio_chan_stream_set(struct zio_channel *chan, int on);
 
 extern int zio_init_buffer_fops(struct zio_buffer_type *zbuf);
 extern int zio_fini_buffer_fops(struct zio_buffer_type *zbuf);
 
+/* Defined in core.c, used in bus.c */
+extern void zio_ctrl_cache_stats(unsigned long *hits, unsigned long *misses);
+
 /* Exported but those that know to be the default */
 extern int zio_default_buffer_init(void);
 extern void zio_default_buffer_exit(void);